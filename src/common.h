@@ -0,0 +1,25 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_COMMON_H
+#define TR_CHECK_COMMON_H
+
+#define PRINT_MEMORY_ERROR() fprintf(stderr, "ERROR: Insufficient memory\n\n");
+
+#endif
@@ -0,0 +1,402 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <stdio.h> // printf(), fprintf()
+#include <stdlib.h> // malloc(), free()
+#include <string.h> // memcmp(), memcpy(), strcmp()
+#include <time.h> // time()
+#include <inttypes.h> // PRIu64
+// libtransmission
+#include <libtransmission/transmission.h>
+#include <libtransmission/variant.h>
+#include <libtransmission/utils.h> // tr_free()
+
+#include "common.h"
+#include "compact.h"
+#include "io.h"
+#include "metrics.h"
+#include "variant_cmp.h"
+
+// sizeof(tr_pex) in libtransmission 2.84 (peers2 & peers2-6 are arrays of tr_pex)
+#define PEX_SIZE 24
+// Constant of libtransmission (resume.c)
+#define MAX_REMEMBERED_PEERS 200
+// Peers of torrents inactive since more than 30 days are stale
+#define PEERS_MAX_AGE (30 * 24 * 3600)
+// Parses measured per version of a resume file (the best one is kept),
+// including the parses needed by the compaction itself
+#define PARSE_RUNS 3
+
+
+static bool is_full_bitfield(const uint8_t raw[], size_t len, bool seed)
+{
+    /* Tell if a blocks bitfield has all its bits set.
+     * The number of blocks is not known here: the last byte may have
+     * padding bits (0), it is only accepted if the torrent is a seed.
+     */
+
+    uint8_t last;
+    size_t i;
+
+    if (len == 0)
+        return false;
+
+    for (i = 0; i < len - 1; i++) {
+        if (raw[i] != 0xFF)
+            return false;
+    }
+
+    last = raw[len - 1];
+    if (last == 0xFF)
+        return true;
+
+    // Leading ones followed by padding: ~last + 1 is a power of 2
+    return seed && last != 0 && ((((uint8_t)~last + 1) & (uint8_t)~last) == 0);
+}
+
+
+static bool is_empty_bitfield(const uint8_t raw[], size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (raw[i] != 0)
+            return false;
+    }
+    return len > 0;
+}
+
+
+static int compact_progress(tr_variant * top)
+{
+    /* Blocks bitfield: "all"/"none" instead of the raw bitfield.
+     * Legacy fields ignored by libtransmission when newer ones exist
+     * (see loadProgress() in resume.c) are dropped.
+     */
+
+    tr_variant * progress;
+    const uint8_t * raw;
+    const char * str;
+    size_t len;
+    int nb_changes = 0;
+
+    if (!tr_variantDictFindDict(top, TR_KEY_progress, &progress))
+        return 0;
+
+    if (tr_variantDictFindRaw(progress, TR_KEY_blocks, &raw, &len)
+            && !(len == 3 && memcmp(raw, "all", 3) == 0)
+            && !(len == 4 && memcmp(raw, "none", 4) == 0)) {
+
+        bool seed = tr_variantDictFindStr(progress, TR_KEY_have, &str, NULL) && strcmp(str, "all") == 0;
+
+        if (is_full_bitfield(raw, len, seed)) {
+            printf("COMPACT: Full blocks bitfield (%zu bytes) replaced by \"all\"\n", len);
+            tr_variantDictAddStr(progress, TR_KEY_blocks, "all");
+            nb_changes++;
+        } else if (is_empty_bitfield(raw, len)) {
+            printf("COMPACT: Empty blocks bitfield (%zu bytes) replaced by \"none\"\n", len);
+            tr_variantDictAddStr(progress, TR_KEY_blocks, "none");
+            nb_changes++;
+        }
+    }
+
+    if (tr_variantDictFind(progress, TR_KEY_blocks)
+            && tr_variantDictRemove(progress, TR_KEY_bitfield)) {
+        printf("COMPACT: Legacy bitfield dropped\n");
+        nb_changes++;
+    }
+
+    if (tr_variantDictFind(progress, TR_KEY_time_checked)
+            && tr_variantDictRemove(progress, TR_KEY_mtimes)) {
+        printf("COMPACT: Legacy mtimes dropped\n");
+        nb_changes++;
+    }
+
+    return nb_changes;
+}
+
+
+static int compact_peers(tr_variant * top)
+{
+    /* Drop stale or malformed peers lists, trim the others to the
+     * number of peers remembered by libtransmission.
+     * Return the number of changes, or -1 on error.
+     */
+
+    static const tr_quark keys[] = { TR_KEY_peers2, TR_KEY_peers2_6 };
+    const size_t max_len = MAX_REMEMBERED_PEERS * PEX_SIZE;
+    const uint8_t * raw;
+    int64_t activity_date;
+    bool stale;
+    size_t len;
+    size_t i;
+    int nb_changes = 0;
+
+    stale = tr_variantDictFindInt(top, TR_KEY_activity_date, &activity_date)
+            && activity_date > 0
+            && time(NULL) - activity_date > PEERS_MAX_AGE;
+
+    for (i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+        const char * name = tr_quark_get_string(keys[i], NULL);
+
+        if (!tr_variantDictFindRaw(top, keys[i], &raw, &len))
+            continue;
+
+        if (stale || len % PEX_SIZE != 0) {
+            printf("COMPACT: %s %s peers dropped (%zu bytes)\n",
+                   stale ? "Stale" : "Malformed", name, len);
+            tr_variantDictRemove(top, keys[i]);
+            nb_changes++;
+
+        } else if (len > max_len) {
+            // 'raw' is freed when the value is replaced
+            uint8_t * trimmed = malloc(max_len);
+
+            if (trimmed == NULL) {
+                PRINT_MEMORY_ERROR()
+                return -1;
+            }
+
+            memcpy(trimmed, raw, max_len);
+            tr_variantDictAddRaw(top, keys[i], trimmed, max_len);
+            free(trimmed);
+
+            printf("COMPACT: %s trimmed to %d peers\n", name, MAX_REMEMBERED_PEERS);
+            nb_changes++;
+        }
+    }
+
+    return nb_changes;
+}
+
+
+static bool is_zero_list(tr_variant * list)
+{
+    int64_t i;
+    size_t n;
+
+    for (n = 0; n < tr_variantListSize(list); n++) {
+        if (!tr_variantGetInt(tr_variantListChild(list, n), &i) || i != 0)
+            return false;
+    }
+    return true;
+}
+
+
+static int drop_defaults(tr_variant * top)
+{
+    /* Drop the fields equal to the values libtransmission uses
+     * when they are missing.
+     */
+
+    static const tr_quark zero_lists[] = { TR_KEY_dnd, TR_KEY_priority };
+    static const tr_quark zero_ints[] = { TR_KEY_corrupt, TR_KEY_bandwidth_priority };
+    tr_variant * list;
+    const char * str;
+    int64_t value;
+    size_t i;
+    int nb_changes = 0;
+
+    // All files wanted, normal priority
+    for (i = 0; i < sizeof(zero_lists) / sizeof(*zero_lists); i++) {
+        if (tr_variantDictFindList(top, zero_lists[i], &list) && is_zero_list(list)) {
+            printf("COMPACT: Default %s dropped\n", tr_quark_get_string(zero_lists[i], NULL));
+            tr_variantDictRemove(top, zero_lists[i]);
+            nb_changes++;
+        }
+    }
+
+    for (i = 0; i < sizeof(zero_ints) / sizeof(*zero_ints); i++) {
+        if (tr_variantDictFindInt(top, zero_ints[i], &value) && value == 0) {
+            printf("COMPACT: Default %s dropped\n", tr_quark_get_string(zero_ints[i], NULL));
+            tr_variantDictRemove(top, zero_ints[i]);
+            nb_changes++;
+        }
+    }
+
+    // No renamed files
+    if (tr_variantDictFindList(top, TR_KEY_files, &list) && tr_variantListSize(list) == 0) {
+        printf("COMPACT: Empty files list dropped\n");
+        tr_variantDictRemove(top, TR_KEY_files);
+        nb_changes++;
+    }
+
+    if (tr_variantDictFindStr(top, TR_KEY_incomplete_dir, &str, NULL) && *str == '\0') {
+        printf("COMPACT: Empty incomplete-dir dropped\n");
+        tr_variantDictRemove(top, TR_KEY_incomplete_dir);
+        nb_changes++;
+    }
+
+    return nb_changes;
+}
+
+
+static uint64_t measure_parse(const void * buffer, size_t len, uint64_t first)
+{
+    /* Best duration (ns) of several parses of a bencoded buffer,
+     * the first one (already done by the caller) lasting 'first' ns.
+     */
+
+    tr_variant top;
+    uint64_t best = first;
+    uint64_t start, elapsed;
+    int i;
+
+    for (i = 1; i < PARSE_RUNS; i++) {
+        start = metrics_now();
+        if (tr_variantFromBenc(&top, buffer, len) == 0)
+            tr_variantFree(&top);
+        elapsed = metrics_now() - start;
+
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+
+trc_verdict compact_resume_file(const char path[], bool make_changes, compact_totals * totals)
+{
+    /* Rewrite a resume file in its canonical minimal form.
+     * The compacted form is validated by parsing it again with the
+     * loader of libtransmission.
+     * Return TRC_VERDICT_OK if it is already compact, TRC_VERDICT_INCONSISTENT if it
+     * could be compacted (make_changes is false), TRC_VERDICT_REPAIRED if it was.
+     */
+
+    uint8_t * buffer = NULL;
+    size_t len;
+    char * compacted = NULL;
+    int compacted_len = 0;
+    tr_variant top, check;
+    uint64_t start, parse_before, parse_after;
+    trc_verdict verdict = TRC_VERDICT_OK;
+    int nb_changes = 0;
+    int nb_peers_changes;
+    int parse_err;
+
+    if (read_file(path, &buffer, &len) == -1)
+        return TRC_VERDICT_ERROR;
+
+    start = metrics_now();
+    parse_err = tr_variantFromBenc(&top, buffer, len);
+    parse_before = metrics_now() - start;
+
+    if (parse_err) {
+        fprintf(stderr, "ERROR: Resume file could not be opened !\n");
+        free(buffer);
+        return TRC_VERDICT_ERROR;
+    }
+
+    nb_changes += compact_progress(&top);
+
+    nb_peers_changes = compact_peers(&top);
+    if (nb_peers_changes == -1) {
+        verdict = TRC_VERDICT_ERROR;
+        goto cleanup;
+    }
+    nb_changes += nb_peers_changes;
+
+    nb_changes += drop_defaults(&top);
+
+    // Validate the compacted form
+    compacted = tr_variantToStr(&top, TR_VARIANT_FMT_BENC, &compacted_len);
+
+    if (compacted != NULL) {
+        start = metrics_now();
+        parse_err = tr_variantFromBenc(&check, compacted, compacted_len);
+        parse_after = metrics_now() - start;
+    }
+
+    if (compacted == NULL || parse_err) {
+        fprintf(stderr, "ERROR: Compacted resume file could not be parsed !\n");
+        verdict = TRC_VERDICT_ERROR;
+        goto cleanup;
+    }
+
+    if (!variant_equal(&top, &check)) {
+        fprintf(stderr, "ERROR: Compacted resume file is not loaded identically !\n");
+        tr_variantFree(&check);
+        verdict = TRC_VERDICT_ERROR;
+        goto cleanup;
+    }
+    tr_variantFree(&check);
+
+    // Non canonical encoding (keys order, integers...)
+    if (nb_changes == 0 && ((size_t)compacted_len != len || memcmp(compacted, buffer, len) != 0)) {
+        printf("COMPACT: Canonical encoding\n");
+        nb_changes++;
+    }
+
+    // Best of PARSE_RUNS, counting the two parses above
+    parse_before = measure_parse(buffer, len, parse_before);
+    parse_after = measure_parse(compacted, compacted_len, parse_after);
+
+    printf("COMPACT: %zu -> %d bytes, parse time: %.1f -> %.1f us\n",
+           len, compacted_len, parse_before / 1e3, parse_after / 1e3);
+
+    totals->parse_ns_before += parse_before;
+    totals->parse_ns_after += parse_after;
+
+    totals->nb_files++;
+    totals->bytes_before += len;
+    totals->bytes_after += compacted_len;
+
+    if (nb_changes == 0) {
+        verdict = TRC_VERDICT_OK;
+    } else if (!make_changes) {
+        verdict = TRC_VERDICT_INCONSISTENT;
+    } else if (tr_variantToFile(&top, TR_VARIANT_FMT_BENC, path)) {
+        fprintf(stderr, "ERROR: While saving the new .resume file\n");
+        verdict = TRC_VERDICT_ERROR;
+    } else {
+        printf("The file was successfully compacted.\n");
+        verdict = TRC_VERDICT_REPAIRED;
+    }
+
+cleanup:
+    tr_free(compacted);
+    tr_variantFree(&top);
+    free(buffer);
+    return verdict;
+}
+
+
+void print_compact_totals(const compact_totals * totals)
+{
+    /* Bytes saved and parse time reduction of all the compacted files.
+     */
+
+    int64_t saved = (int64_t)totals->bytes_before - (int64_t)totals->bytes_after;
+
+    if (totals->nb_files == 0 || totals->bytes_before == 0)
+        return;
+
+    printf("\nCompaction of %d files: %" PRIu64 " -> %" PRIu64 " bytes (%" PRId64 " bytes saved, %.1f%%)\n",
+           totals->nb_files, totals->bytes_before, totals->bytes_after,
+           saved, 100.0 * saved / totals->bytes_before);
+
+    // Below the resolution of the clock
+    if (totals->parse_ns_before == 0)
+        return;
+
+    printf("Parse time: %.1f -> %.1f us (%.1f%% faster)\n",
+           totals->parse_ns_before / 1e3, totals->parse_ns_after / 1e3,
+           100.0 * ((double)totals->parse_ns_before - totals->parse_ns_after) / totals->parse_ns_before);
+}
@@ -0,0 +1,39 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_COMPACT_H
+#define TR_CHECK_COMPACT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "trcheck.h"
+
+typedef struct compact_totals {
+    int nb_files;
+    uint64_t bytes_before;
+    uint64_t bytes_after;
+    uint64_t parse_ns_before;
+    uint64_t parse_ns_after;
+} compact_totals;
+
+trc_verdict compact_resume_file(const char path[], bool make_changes, compact_totals * totals);
+void print_compact_totals(const compact_totals * totals);
+
+#endif
@@ -0,0 +1,684 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <stdio.h> // printf(), fprintf()
+#include <stdlib.h> // calloc(), free()
+#include <string.h> // memcmp(), strcmp(), strchr(), strlen()
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h> // PRId64
+#include <ctype.h> // isprint()
+#include <unistd.h> // unlink()
+// libtransmission
+#include <libtransmission/transmission.h>
+#include <libtransmission/variant.h>
+
+#include "common.h"
+#include "diff.h"
+#include "digest.h"
+#include "io.h"
+#include "resume_dir.h"
+#include "shard.h"
+#include "variant_cmp.h"
+
+/* Patch format (bencoded, written and read with tr_variant):
+ *
+ *     transmission-check-patch: PATCH_VERSION
+ *     files: [
+ *         name: <resume filename in dir A>
+ *         base: <digest64 of the file in dir A>
+ *         set: { <key>: <value of dir B>, ... }
+ *         del: [ <key>, ... ]
+ *         rename: <resume filename in dir B>  (optional)
+ *     ,
+ *         name: <resume filename only in dir A>
+ *         base: <digest64 of the file in dir A>
+ *         remove: 1
+ *     ,
+ *         name: <resume filename only in dir B>
+ *         content: <whole resume file of dir B>
+ *     ]
+ *
+ * Applied to dir A, it gives dir B. A file whose digest is not the base
+ * digest has changed since the diff and is not patched; a new file is not
+ * added over a different one.
+ * Filenames are values, not dict keys: libtransmission would add each of
+ * them to its quark table (linear lookups, never freed).
+ */
+#define PATCH_VERSION 3
+#define MAX_PRINTED_LEN 80
+
+typedef struct join_slot {
+    uint64_t hash; // 0 = free slot
+    int index; // in the names of dir B
+    int index_a; // in the names of dir A, -1 = not matched yet
+} join_slot;
+
+typedef struct diff_counts {
+    int identical;
+    int changed;
+    int only_a;
+    int only_b;
+    int errors;
+} diff_counts;
+
+
+static tr_quark patch_quark(const char str[])
+{
+    return tr_quark_new(str, strlen(str));
+}
+
+
+static tr_variant * add_patch_entry(tr_variant * files, const char name[], size_t reserve)
+{
+    tr_variant * entry = tr_variantListAddDict(files, reserve + 1);
+
+    tr_variantDictAddStr(entry, patch_quark("name"), name);
+    return entry;
+}
+
+
+static uint64_t join_hash(const char name[])
+{
+    size_t len;
+    const char * key = resume_join_key(name, &len);
+    uint64_t hash = digest64(key, len, 0);
+
+    return (hash != 0) ? hash : 1;
+}
+
+
+static bool same_join_key(const char name_a[], const char name_b[])
+{
+    size_t len_a, len_b;
+    const char * key_a = resume_join_key(name_a, &len_a);
+    const char * key_b = resume_join_key(name_b, &len_b);
+
+    return len_a == len_b && memcmp(key_a, key_b, len_a) == 0;
+}
+
+
+static join_slot * find_slot(join_slot table[], size_t capacity, uint64_t hash,
+                             char ** names, const char name[])
+{
+    size_t mask = capacity - 1;
+    size_t slot = hash & mask;
+
+    while (table[slot].hash != 0
+            && (table[slot].hash != hash || !same_join_key(names[table[slot].index], name)))
+        slot = (slot + 1) & mask;
+
+    return &table[slot];
+}
+
+
+static void print_value(tr_variant * value)
+{
+    const uint8_t * raw;
+    size_t len, i;
+    int64_t integer;
+
+    if (tr_variantGetRaw(value, &raw, &len)) {
+        for (i = 0; i < len && isprint(raw[i]); i++)
+            ;
+
+        if (i == len && len <= MAX_PRINTED_LEN)
+            printf("\"%.*s\"", (int)len, (const char *)raw);
+        else
+            printf("<%zu bytes>", len);
+
+    } else if (tr_variantIsList(value)) {
+        printf("<list of %zu>", tr_variantListSize(value));
+    } else if (tr_variantIsDict(value)) {
+        printf("<dict>");
+    } else if (tr_variantGetInt(value, &integer)) {
+        printf("%" PRId64, integer);
+    } else {
+        printf("<?>");
+    }
+}
+
+
+static void variant_copy(tr_variant * dst, tr_variant * src)
+{
+    /* Deep copy of 'src' into 'dst' (a new child of a container).
+     */
+
+    const uint8_t * raw;
+    tr_variant * child;
+    tr_quark key;
+    size_t len, i;
+    int64_t integer;
+    double real;
+
+    if (tr_variantGetRaw(src, &raw, &len)) {
+        tr_variantInitRaw(dst, raw, len);
+
+    } else if (tr_variantIsList(src)) {
+        len = tr_variantListSize(src);
+        tr_variantInitList(dst, len);
+        for (i = 0; i < len; i++)
+            variant_copy(tr_variantListAdd(dst), tr_variantListChild(src, i));
+
+    } else if (tr_variantIsDict(src)) {
+        tr_variantInitDict(dst, 0);
+        for (i = 0; tr_variantDictChild(src, i, &key, &child); i++)
+            variant_copy(tr_variantDictAdd(dst, key), child);
+
+    } else if (tr_variantIsReal(src) && tr_variantGetReal(src, &real)) {
+        tr_variantInitReal(dst, real);
+
+    } else if (tr_variantGetInt(src, &integer)) {
+        tr_variantInitInt(dst, integer);
+    }
+}
+
+
+static int compare_pair(const char dir_a[], const char name_a[],
+                        const char dir_b[], const char name_b[], tr_variant * files)
+{
+    /* Compare two resume files with the same info-hash suffix.
+     * Byte-identical files are skipped by digest; the others are compared
+     * key by key and their differences are added to the patch (if any).
+     * Return 0 if identical, 1 if different, -1 on error.
+     */
+
+    char * path_a = join_path(dir_a, name_a);
+    char * path_b = join_path(dir_b, name_b);
+    uint8_t * buffer_a = NULL, * buffer_b = NULL;
+    size_t len_a, len_b;
+    bool renamed = strcmp(name_a, name_b) != 0;
+    tr_variant top_a, top_b;
+    tr_variant * entry = NULL, * set = NULL, * del = NULL;
+    tr_variant * value_a, * value_b;
+    tr_quark key;
+    size_t i;
+    int ret = -1;
+
+    if (read_file(path_a, &buffer_a, &len_a) == -1 || read_file(path_b, &buffer_b, &len_b) == -1)
+        goto cleanup;
+
+    if (!renamed && len_a == len_b && digest64(buffer_a, len_a, 0) == digest64(buffer_b, len_b, 0)) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (tr_variantFromBenc(&top_a, buffer_a, len_a)) {
+        fprintf(stderr, "ERROR: Resume file '%s' could not be parsed !\n", path_a);
+        goto cleanup;
+    }
+
+    if (tr_variantFromBenc(&top_b, buffer_b, len_b)) {
+        fprintf(stderr, "ERROR: Resume file '%s' could not be parsed !\n", path_b);
+        tr_variantFree(&top_a);
+        goto cleanup;
+    }
+
+    // Only the encoding differs
+    if (!renamed && variant_equal(&top_a, &top_b)) {
+        ret = 0;
+        goto free_variants;
+    }
+
+    ret = 1;
+    if (renamed)
+        printf("~ %s -> %s\n", name_a, name_b);
+    else
+        printf("~ %s\n", name_a);
+
+    if (files) {
+        entry = add_patch_entry(files, name_a, 4);
+        tr_variantDictAddInt(entry, patch_quark("base"), (int64_t)digest64(buffer_a, len_a, 0));
+        if (renamed)
+            tr_variantDictAddStr(entry, patch_quark("rename"), name_b);
+        // Last children added: their pointers stay valid
+        set = tr_variantDictAddDict(entry, patch_quark("set"), 0);
+        del = tr_variantDictAddList(entry, patch_quark("del"), 0);
+    }
+
+    // Removed or modified keys
+    for (i = 0; tr_variantDictChild(&top_a, i, &key, &value_a); i++) {
+        const char * key_name = tr_quark_get_string(key, NULL);
+
+        value_b = tr_variantDictFind(&top_b, key);
+
+        if (value_b == NULL) {
+            printf("    - %s: ", key_name);
+            print_value(value_a);
+            printf("\n");
+
+            if (del)
+                tr_variantListAddStr(del, key_name);
+
+        } else if (!variant_equal(value_a, value_b)) {
+            printf("    ~ %s: ", key_name);
+            print_value(value_a);
+            printf(" -> ");
+            print_value(value_b);
+            printf("\n");
+
+            if (set)
+                variant_copy(tr_variantDictAdd(set, key), value_b);
+        }
+    }
+
+    // Added keys
+    for (i = 0; tr_variantDictChild(&top_b, i, &key, &value_b); i++) {
+        if (tr_variantDictFind(&top_a, key) != NULL)
+            continue;
+
+        printf("    + %s: ", tr_quark_get_string(key, NULL));
+        print_value(value_b);
+        printf("\n");
+
+        if (set)
+            variant_copy(tr_variantDictAdd(set, key), value_b);
+    }
+
+free_variants:
+    tr_variantFree(&top_a);
+    tr_variantFree(&top_b);
+
+cleanup:
+    free(buffer_a);
+    free(buffer_b);
+    free(path_a);
+    free(path_b);
+    return ret;
+}
+
+
+static void add_new_file(const char dir_b[], const char name_b[], tr_variant * files, diff_counts * counts)
+{
+    /* Resume file only in dir B: the patch carries its whole content.
+     */
+
+    char * path = join_path(dir_b, name_b);
+    uint8_t * buffer;
+    size_t len;
+    tr_variant * entry;
+
+    printf("+ %s\n", name_b);
+    counts->only_b++;
+
+    if (files) {
+        if (read_file(path, &buffer, &len) == -1) {
+            counts->errors++;
+        } else {
+            entry = add_patch_entry(files, name_b, 1);
+            tr_variantDictAddRaw(entry, patch_quark("content"), buffer, len);
+            free(buffer);
+        }
+    }
+
+    free(path);
+}
+
+
+static void add_removed_file(const char dir_a[], const char name_a[], tr_variant * files, diff_counts * counts)
+{
+    /* Resume file only in dir A: the patch removes it, if it is unchanged.
+     */
+
+    char * path = join_path(dir_a, name_a);
+    uint8_t * buffer;
+    size_t len;
+    tr_variant * entry;
+
+    printf("- %s\n", name_a);
+    counts->only_a++;
+
+    if (files) {
+        if (read_file(path, &buffer, &len) == -1) {
+            counts->errors++;
+        } else {
+            entry = add_patch_entry(files, name_a, 2);
+            tr_variantDictAddInt(entry, patch_quark("base"), (int64_t)digest64(buffer, len, 0));
+            tr_variantDictAddInt(entry, patch_quark("remove"), 1);
+            free(buffer);
+        }
+    }
+
+    free(path);
+}
+
+
+int diff_resume_dirs(const char dir_a[], const char dir_b[], const char patch_path[])
+{
+    /* Compare two resume directories (e.g. live vs backup).
+     * Files are joined on their info-hash suffix with a hash table.
+     * If patch_path is not NULL, a patch turning dir A into dir B is written.
+     */
+
+    char ** names_a = NULL, ** names_b = NULL;
+    int nb_a, nb_b;
+    join_slot * table = NULL;
+    bool * matched = NULL;
+    size_t capacity = 64;
+    tr_variant patch;
+    tr_variant * files = NULL;
+    diff_counts counts = { 0, 0, 0, 0, 0 };
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    nb_a = list_resume_files(dir_a, &names_a);
+    if (nb_a == -1)
+        return EXIT_FAILURE;
+
+    nb_b = list_resume_files(dir_b, &names_b);
+    if (nb_b == -1) {
+        ret = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    while (capacity < 2 * (size_t)nb_b)
+        capacity *= 2;
+
+    table = calloc(capacity, sizeof(*table));
+    matched = calloc(nb_b > 0 ? nb_b : 1, sizeof(*matched));
+    if (table == NULL || matched == NULL) {
+        PRINT_MEMORY_ERROR()
+        exit(EXIT_FAILURE);
+    }
+
+    // Build side: dir B
+    for (i = 0; i < nb_b; i++) {
+        uint64_t hash = join_hash(names_b[i]);
+        join_slot * slot = find_slot(table, capacity, hash, names_b, names_b[i]);
+
+        if (slot->hash != 0) {
+            fprintf(stderr, "WARNING: '%s' and '%s' have the same info-hash suffix, '%s' ignored\n",
+                    names_b[slot->index], names_b[i], names_b[i]);
+            matched[i] = true;
+            continue;
+        }
+        slot->hash = hash;
+        slot->index = i;
+        slot->index_a = -1;
+    }
+
+    if (patch_path) {
+        tr_variantInitDict(&patch, 2);
+        tr_variantDictAddInt(&patch, patch_quark("transmission-check-patch"), PATCH_VERSION);
+        files = tr_variantDictAddList(&patch, patch_quark("files"), 0);
+    }
+
+    // Probe side: dir A
+    for (i = 0; i < nb_a; i++) {
+        join_slot * slot = find_slot(table, capacity, join_hash(names_a[i]), names_b, names_a[i]);
+
+        if (slot->hash == 0) {
+            add_removed_file(dir_a, names_a[i], files, &counts);
+            continue;
+        }
+
+        if (slot->index_a != -1) {
+            fprintf(stderr, "WARNING: '%s' and '%s' have the same info-hash suffix, '%s' ignored\n",
+                    names_a[slot->index_a], names_a[i], names_a[i]);
+            continue;
+        }
+        slot->index_a = i;
+        matched[slot->index] = true;
+
+        switch (compare_pair(dir_a, names_a[i], dir_b, names_b[slot->index], files)) {
+        case 0:  counts.identical++; break;
+        case 1:  counts.changed++;   break;
+        default: counts.errors++;    break;
+        }
+    }
+
+    for (i = 0; i < nb_b; i++) {
+        if (!matched[i])
+            add_new_file(dir_b, names_b[i], files, &counts);
+    }
+
+    printf("\nIdentical: %d, changed: %d, only in '%s': %d, only in '%s': %d, errors: %d\n",
+           counts.identical, counts.changed, dir_a, counts.only_a, dir_b, counts.only_b, counts.errors);
+
+    if (patch_path) {
+        if (tr_variantToFile(&patch, TR_VARIANT_FMT_BENC, patch_path)) {
+            fprintf(stderr, "ERROR: Patch '%s' could not be written !\n", patch_path);
+            ret = EXIT_FAILURE;
+        }
+        tr_variantFree(&patch);
+    }
+
+    if (counts.errors > 0)
+        ret = EXIT_FAILURE;
+
+cleanup:
+    for (i = 0; i < nb_a; i++)
+        free(names_a[i]);
+    for (i = 0; i < nb_b; i++)
+        free(names_b[i]);
+    free(names_a);
+    free(names_b);
+    free(table);
+    free(matched);
+    return ret;
+}
+
+
+static int read_base(const char path[], tr_variant * entry, uint8_t ** buffer, size_t * len)
+{
+    /* Read a file of the directory to patch and check that it is the
+     * base of its patch entry.
+     * Return 0 on success, -1 on error.
+     * The buffer must be freed by the caller.
+     */
+
+    int64_t base;
+
+    if (!tr_variantDictFindInt(entry, patch_quark("base"), &base)) {
+        fprintf(stderr, "ERROR: No base digest for '%s' in the patch !\n", path);
+        return -1;
+    }
+
+    if (read_file(path, buffer, len) == -1)
+        return -1;
+
+    // Changed since the diff: the patch would revert these changes
+    if (digest64(*buffer, *len, 0) != (uint64_t)base) {
+        fprintf(stderr, "ERROR: '%s' differs from the base of the patch, not patched !\n", path);
+        free(*buffer);
+        *buffer = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int apply_entry(const char dir_path[], const char name[], tr_variant * entry, bool make_changes)
+{
+    /* Apply the patch of one resume file.
+     * Return 0 on success, -1 on error.
+     */
+
+    char * path = join_path(dir_path, name);
+    char * new_path = NULL;
+    uint8_t * buffer;
+    const uint8_t * raw;
+    const char * new_name;
+    tr_variant top;
+    tr_variant * list, * set, * child;
+    tr_quark key;
+    int64_t flag;
+    size_t len, existing_len, i;
+    int ret = 0;
+
+    if (tr_variantDictFindInt(entry, patch_quark("remove"), &flag)) {
+        if (read_base(path, entry, &buffer, &len) == -1) {
+            ret = -1;
+            goto cleanup;
+        }
+        free(buffer);
+
+        printf("REMOVE: %s\n", name);
+
+        if (make_changes && unlink(path) == -1) {
+            perror("unlink");
+            ret = -1;
+        }
+        goto cleanup;
+    }
+
+    if (tr_variantDictFindRaw(entry, patch_quark("content"), &raw, &len)) {
+        // Created since the diff: added only if it has the same content
+        if (access(path, F_OK) == 0) {
+            if (read_file(path, &buffer, &existing_len) == -1) {
+                ret = -1;
+                goto cleanup;
+            }
+
+            if (existing_len != len || digest64(buffer, existing_len, 0) != digest64(raw, len, 0)) {
+                fprintf(stderr, "ERROR: '%s' already exists with another content, not added !\n", path);
+                ret = -1;
+            } else {
+                printf("ADD: %s (already present)\n", name);
+            }
+            free(buffer);
+            goto cleanup;
+        }
+
+        printf("ADD: %s\n", name);
+        if (tr_variantFromBenc(&top, raw, len)) {
+            fprintf(stderr, "ERROR: Content of '%s' could not be parsed !\n", name);
+            ret = -1;
+            goto cleanup;
+        }
+
+    } else {
+        if (read_base(path, entry, &buffer, &len) == -1) {
+            ret = -1;
+            goto cleanup;
+        }
+
+        if (tr_variantFromBenc(&top, buffer, len)) {
+            fprintf(stderr, "ERROR: Resume file '%s' could not be parsed !\n", path);
+            free(buffer);
+            ret = -1;
+            goto cleanup;
+        }
+        free(buffer);
+
+        if (tr_variantDictFindList(entry, patch_quark("del"), &list)) {
+            for (i = 0; i < tr_variantListSize(list); i++) {
+                const char * key_name;
+
+                if (tr_variantGetStr(tr_variantListChild(list, i), &key_name, &len))
+                    tr_variantDictRemove(&top, tr_quark_new(key_name, len));
+            }
+        }
+
+        if (tr_variantDictFindDict(entry, patch_quark("set"), &set)) {
+            for (i = 0; tr_variantDictChild(set, i, &key, &child); i++) {
+                tr_variantDictRemove(&top, key);
+                variant_copy(tr_variantDictAdd(&top, key), child);
+            }
+        }
+
+        if (tr_variantDictFindStr(entry, patch_quark("rename"), &new_name, NULL)) {
+            if (!is_safe_name(new_name)) {
+                fprintf(stderr, "ERROR: Invalid new name '%s' for '%s' !\n", new_name, name);
+                tr_variantFree(&top);
+                ret = -1;
+                goto cleanup;
+            }
+            new_path = join_path(dir_path, new_name);
+            printf("UPDATE: %s -> %s\n", name, new_name);
+        } else {
+            printf("UPDATE: %s\n", name);
+        }
+    }
+
+    if (make_changes) {
+        if (tr_variantToFile(&top, TR_VARIANT_FMT_BENC, new_path ? new_path : path)) {
+            fprintf(stderr, "ERROR: While saving '%s'\n", new_path ? new_path : path);
+            ret = -1;
+        } else if (new_path && unlink(path) == -1) {
+            perror("unlink");
+            ret = -1;
+        }
+    }
+
+    tr_variantFree(&top);
+
+cleanup:
+    free(path);
+    free(new_path);
+    return ret;
+}
+
+
+int apply_patch(const char patch_path[], const char dir_path[], bool make_changes)
+{
+    /* Apply a patch written by diff_resume_dirs() to a resume directory.
+     * Files are only written if make_changes is true.
+     */
+
+    tr_variant patch;
+    tr_variant * files, * entry;
+    const char * name;
+    int64_t version;
+    int nb_applied = 0, nb_errors = 0;
+    size_t i;
+
+    if (tr_variantFromFile(&patch, TR_VARIANT_FMT_BENC, patch_path)) {
+        fprintf(stderr, "ERROR: Patch '%s' could not be opened !\n", patch_path);
+        return EXIT_FAILURE;
+    }
+
+    if (!tr_variantDictFindInt(&patch, patch_quark("transmission-check-patch"), &version)
+            || version != PATCH_VERSION
+            || !tr_variantDictFindList(&patch, patch_quark("files"), &files)) {
+        fprintf(stderr, "ERROR: '%s' is not a patch (version %d) !\n", patch_path, PATCH_VERSION);
+        tr_variantFree(&patch);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < tr_variantListSize(files); i++) {
+        entry = tr_variantListChild(files, i);
+
+        if (!tr_variantIsDict(entry) || !tr_variantDictFindStr(entry, patch_quark("name"), &name, NULL)) {
+            fprintf(stderr, "ERROR: Invalid patch entry %zu !\n", i);
+            nb_errors++;
+            continue;
+        }
+
+        if (!is_safe_name(name)) {
+            fprintf(stderr, "ERROR: Invalid patch entry '%s' !\n", name);
+            nb_errors++;
+            continue;
+        }
+
+        if (apply_entry(dir_path, name, entry, make_changes) == 0)
+            nb_applied++;
+        else
+            nb_errors++;
+    }
+
+    tr_variantFree(&patch);
+
+    printf("\nPatched files: %d, errors: %d\n", nb_applied, nb_errors);
+    if (!make_changes)
+        printf("The files remain untouched (use -m to apply the patch).\n");
+
+    return (nb_errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,28 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_DIFF_H
+#define TR_CHECK_DIFF_H
+
+#include <stdbool.h>
+
+int diff_resume_dirs(const char dir_a[], const char dir_b[], const char patch_path[]);
+int apply_patch(const char patch_path[], const char dir_path[], bool make_changes);
+
+#endif
@@ -0,0 +1,520 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#define _GNU_SOURCE // syscall()
+#include <stdio.h> // printf(), fprintf()
+#include <stdlib.h> // calloc(), free()
+#include <string.h> // memcpy(), strchr(), strcmp(), strcpy(), strcspn(), strdup(), strlen()
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h> // open()
+#include <unistd.h> // close(), syscall()
+#include <sys/syscall.h> // SYS_getdents64
+// libtransmission
+#include <libtransmission/transmission.h>
+#include <libtransmission/variant.h>
+
+#include "common.h"
+#include "digest.h"
+#include "dir_index.h"
+#include "resume_dir.h"
+
+#define GETDENTS_BUFFER_SIZE (1024 * 1024)
+#define MIN_CAPACITY 64
+
+/* Batch resolution of the downloaded files: every distinct destination
+ * (and incomplete) directory is read once with getdents64() into a hash
+ * set of its entries; torrents names are then resolved in memory.
+ * Entries never resolved are payloads that no resume file references.
+ */
+
+// Layout of the records returned by getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct name_entry {
+    uint64_t hash; // 0 = free slot
+    char * name;
+    bool referenced;
+} name_entry;
+
+typedef struct dir_listing {
+    uint64_t hash; // 0 = free slot
+    char * path;
+    bool readable;
+    name_entry * entries;
+    size_t capacity;
+    size_t count;
+} dir_listing;
+
+typedef struct dir_set {
+    dir_listing * dirs;
+    size_t capacity;
+    size_t count;
+} dir_set;
+
+typedef struct torrent_location {
+    char * resume_name;
+    char * name;
+    char * destination;
+    char * incomplete_dir; // may be NULL
+} torrent_location;
+
+
+static uint64_t string_hash(const char str[])
+{
+    uint64_t hash = digest64(str, strlen(str), 0);
+    return (hash != 0) ? hash : 1;
+}
+
+
+static void * alloc_or_die(size_t nmemb, size_t size)
+{
+    void * ptr = calloc(nmemb, size);
+
+    if (ptr == NULL) {
+        PRINT_MEMORY_ERROR()
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+
+static char * strdup_or_die(const char str[])
+{
+    char * copy = strdup(str);
+
+    if (copy == NULL) {
+        PRINT_MEMORY_ERROR()
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+
+static char * normalize_dir(const char path[])
+{
+    /* Copy of a directory path without its trailing slashes,
+     * so that "/data/" and "/data" are listed once.
+     */
+
+    char * copy = strdup_or_die(path);
+    size_t len = strlen(copy);
+
+    while (len > 1 && copy[len - 1] == '/')
+        copy[--len] = '\0';
+
+    return copy;
+}
+
+
+static name_entry * find_name(dir_listing * dir, const char name[], uint64_t hash)
+{
+    /* Slot of the name, or free slot where to insert it.
+     * Return NULL if the listing is empty (no slot allocated).
+     */
+
+    size_t mask = dir->capacity - 1;
+    size_t slot = hash & mask;
+
+    if (dir->capacity == 0)
+        return NULL;
+
+    while (dir->entries[slot].hash != 0
+            && (dir->entries[slot].hash != hash || strcmp(dir->entries[slot].name, name) != 0))
+        slot = (slot + 1) & mask;
+
+    return &dir->entries[slot];
+}
+
+
+static void add_name(dir_listing * dir, const char name[])
+{
+    uint64_t hash = string_hash(name);
+    name_entry * entry;
+
+    // Load factor <= 0.5
+    if (2 * (dir->count + 1) > dir->capacity) {
+        name_entry * old_entries = dir->entries;
+        size_t old_capacity = dir->capacity;
+        size_t i;
+
+        dir->capacity = old_capacity ? old_capacity * 2 : MIN_CAPACITY;
+        dir->entries = alloc_or_die(dir->capacity, sizeof(*dir->entries));
+
+        for (i = 0; i < old_capacity; i++) {
+            if (old_entries[i].hash != 0)
+                *find_name(dir, old_entries[i].name, old_entries[i].hash) = old_entries[i];
+        }
+        free(old_entries);
+    }
+
+    entry = find_name(dir, name, hash);
+    if (entry->hash == 0) {
+        entry->hash = hash;
+        entry->name = strdup_or_die(name);
+        dir->count++;
+    }
+}
+
+
+static dir_listing * find_dir(dir_set * set, const char path[], uint64_t hash)
+{
+    size_t mask = set->capacity - 1;
+    size_t slot = hash & mask;
+
+    while (set->dirs[slot].hash != 0
+            && (set->dirs[slot].hash != hash || strcmp(set->dirs[slot].path, path) != 0))
+        slot = (slot + 1) & mask;
+
+    return &set->dirs[slot];
+}
+
+
+static void add_dir(dir_set * set, const char path[])
+{
+    uint64_t hash = string_hash(path);
+    dir_listing * dir;
+
+    if (2 * (set->count + 1) > set->capacity) {
+        dir_listing * old_dirs = set->dirs;
+        size_t old_capacity = set->capacity;
+        size_t i;
+
+        set->capacity = old_capacity ? old_capacity * 2 : MIN_CAPACITY;
+        set->dirs = alloc_or_die(set->capacity, sizeof(*set->dirs));
+
+        for (i = 0; i < old_capacity; i++) {
+            if (old_dirs[i].hash != 0)
+                *find_dir(set, old_dirs[i].path, old_dirs[i].hash) = old_dirs[i];
+        }
+        free(old_dirs);
+    }
+
+    dir = find_dir(set, path, hash);
+    if (dir->hash == 0) {
+        dir->hash = hash;
+        dir->path = strdup_or_die(path);
+        set->count++;
+    }
+}
+
+
+static void read_listing(dir_listing * dir, char buffer[])
+{
+    /* Read all the entries of a directory with getdents64().
+     */
+
+    struct linux_dirent64 * record;
+    long nb_read;
+    long pos;
+    int fd;
+
+    fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+
+    // A directory that does not exist is known to be empty
+    if (fd == -1 && errno == ENOENT) {
+        dir->readable = true;
+        return;
+    }
+
+    if (fd == -1) {
+        fprintf(stderr, "WARNING: Directory '%s' could not be opened: %s\n", dir->path, strerror(errno));
+        return;
+    }
+
+    while ((nb_read = syscall(SYS_getdents64, fd, buffer, GETDENTS_BUFFER_SIZE)) > 0) {
+        for (pos = 0; pos < nb_read; pos += record->d_reclen) {
+            record = (struct linux_dirent64 *)(buffer + pos);
+
+            if (strcmp(record->d_name, ".") == 0 || strcmp(record->d_name, "..") == 0)
+                continue;
+
+            add_name(dir, record->d_name);
+        }
+    }
+
+    if (nb_read == -1)
+        fprintf(stderr, "WARNING: Directory '%s' could not be read: %s\n", dir->path, strerror(errno));
+    else
+        dir->readable = true;
+
+    close(fd);
+}
+
+
+static bool resolve(dir_set * set, const char dir_path[], const char name[])
+{
+    /* Look for the name in the listing of the directory, without any syscall.
+     * Single files still downloading may have the ".part" suffix.
+     */
+
+    dir_listing * dir = find_dir(set, dir_path, string_hash(dir_path));
+    name_entry * entry;
+    char * part_name;
+    bool found = false;
+
+    if (dir->hash == 0 || !dir->readable)
+        return false;
+
+    entry = find_name(dir, name, string_hash(name));
+    if (entry && entry->hash != 0) {
+        entry->referenced = true;
+        found = true;
+    }
+
+    part_name = alloc_or_die(strlen(name) + sizeof(".part"), 1);
+    sprintf(part_name, "%s.part", name);
+
+    entry = find_name(dir, part_name, string_hash(part_name));
+    if (entry && entry->hash != 0) {
+        entry->referenced = true;
+        found = true;
+    }
+
+    free(part_name);
+    return found;
+}
+
+
+static bool is_unreadable(dir_set * set, const char dir_path[])
+{
+    dir_listing * dir = find_dir(set, dir_path, string_hash(dir_path));
+
+    return dir->hash != 0 && !dir->readable;
+}
+
+
+static void reference_ancestors(dir_set * set, const char dir_path[])
+{
+    /* A listed directory inside another listed directory (e.g. "/data/tv"
+     * and "/data") is not an orphan of the latter: mark the component of
+     * the path that follows each listed ancestor as referenced.
+     */
+
+    char * ancestor_path = strdup_or_die(dir_path);
+    char * name = strdup_or_die(dir_path);
+    const char * slash;
+    dir_listing * ancestor;
+    name_entry * entry;
+    size_t offset, name_len;
+
+    for (slash = strchr(dir_path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        offset = slash - dir_path;
+        name_len = strcspn(slash + 1, "/");
+        if (name_len == 0)
+            continue;
+
+        // Path before the slash ("/" for the root)
+        strcpy(ancestor_path, dir_path);
+        ancestor_path[(offset > 0) ? offset : 1] = '\0';
+
+        memcpy(name, slash + 1, name_len);
+        name[name_len] = '\0';
+
+        ancestor = find_dir(set, ancestor_path, string_hash(ancestor_path));
+        if (ancestor->hash == 0 || !ancestor->readable)
+            continue;
+
+        entry = find_name(ancestor, name, string_hash(name));
+        if (entry && entry->hash != 0)
+            entry->referenced = true;
+    }
+
+    free(ancestor_path);
+    free(name);
+}
+
+
+static int compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+static int print_orphans(const dir_listing * dir)
+{
+    /* Print the entries of the directory that were not resolved (sorted).
+     * Return their number.
+     */
+
+    char ** orphan_names = alloc_or_die(dir->count > 0 ? dir->count : 1, sizeof(*orphan_names));
+    size_t nb_orphans = 0;
+    size_t i;
+
+    for (i = 0; i < dir->capacity; i++) {
+        if (dir->entries[i].hash != 0 && !dir->entries[i].referenced)
+            orphan_names[nb_orphans++] = dir->entries[i].name;
+    }
+
+    qsort(orphan_names, nb_orphans, sizeof(*orphan_names), compare_names);
+
+    for (i = 0; i < nb_orphans; i++)
+        printf("ORPHAN: %s/%s\n", dir->path, orphan_names[i]);
+
+    free(orphan_names);
+    return nb_orphans;
+}
+
+
+static bool load_location(const char dir_path[], const char resume_name[], torrent_location * torrent)
+{
+    /* Read the name and the directories of a torrent from its resume file.
+     */
+
+    tr_variant top;
+    const char * str;
+    char * path = join_path(dir_path, resume_name);
+    bool ok = false;
+
+    if (tr_variantFromFile(&top, TR_VARIANT_FMT_BENC, path)) {
+        fprintf(stderr, "WARNING: Resume file '%s' could not be opened\n", resume_name);
+        free(path);
+        return false;
+    }
+    free(path);
+
+    if (tr_variantDictFindStr(&top, TR_KEY_name, &str, NULL) && *str) {
+        torrent->name = strdup_or_die(str);
+
+        if (tr_variantDictFindStr(&top, TR_KEY_destination, &str, NULL) && *str) {
+            torrent->destination = normalize_dir(str);
+            ok = true;
+        }
+
+        if (tr_variantDictFindStr(&top, TR_KEY_incomplete_dir, &str, NULL) && *str)
+            torrent->incomplete_dir = normalize_dir(str);
+    }
+
+    if (!ok)
+        fprintf(stderr, "WARNING: Resume file '%s' has no name or destination\n", resume_name);
+
+    tr_variantFree(&top);
+    return ok;
+}
+
+
+int find_orphans(const char dir_path[])
+{
+    /* Resolve the downloaded files of every resume file of the directory,
+     * and list the entries of the destination directories that no resume
+     * file references (orphaned payloads).
+     */
+
+    char ** names = NULL;
+    torrent_location * torrents;
+    dir_set set = { NULL, 0, 0 };
+    char * buffer;
+    int nb_names;
+    int nb_loaded = 0, nb_missing = 0, nb_unresolved = 0, nb_orphans = 0;
+    size_t i, j;
+
+    nb_names = list_resume_files(dir_path, &names);
+    if (nb_names == -1)
+        return EXIT_FAILURE;
+
+    torrents = alloc_or_die(nb_names > 0 ? nb_names : 1, sizeof(*torrents));
+
+    // Distinct directories
+    for (i = 0; i < (size_t)nb_names; i++) {
+        torrents[i].resume_name = names[i];
+
+        if (!load_location(dir_path, names[i], &torrents[i]))
+            continue;
+
+        nb_loaded++;
+        add_dir(&set, torrents[i].destination);
+        if (torrents[i].incomplete_dir)
+            add_dir(&set, torrents[i].incomplete_dir);
+    }
+
+    // One pass per directory
+    buffer = alloc_or_die(GETDENTS_BUFFER_SIZE, 1);
+
+    for (i = 0; i < set.capacity; i++) {
+        if (set.dirs[i].hash != 0)
+            read_listing(&set.dirs[i], buffer);
+    }
+    free(buffer);
+
+    // Resolution in memory
+    for (i = 0; i < (size_t)nb_names; i++) {
+        torrent_location * torrent = &torrents[i];
+
+        if (torrent->destination == NULL)
+            continue;
+
+        if (resolve(&set, torrent->destination, torrent->name)
+                || (torrent->incomplete_dir && resolve(&set, torrent->incomplete_dir, torrent->name)))
+            continue;
+
+        // Not found in a directory that could not be read: the data may still be there
+        if (is_unreadable(&set, torrent->destination)
+                || (torrent->incomplete_dir && is_unreadable(&set, torrent->incomplete_dir))) {
+            printf("UNRESOLVED: %s/%s (%s) (directory unreadable)\n",
+                   torrent->destination, torrent->name, torrent->resume_name);
+            nb_unresolved++;
+        } else {
+            printf("MISSING: %s/%s (%s)\n", torrent->destination, torrent->name, torrent->resume_name);
+            nb_missing++;
+        }
+    }
+
+    // Directories of torrents are not orphans of their parent directories
+    for (i = 0; i < set.capacity; i++) {
+        if (set.dirs[i].hash != 0)
+            reference_ancestors(&set, set.dirs[i].path);
+    }
+
+    // Orphaned payloads
+    for (i = 0; i < set.capacity; i++) {
+        if (set.dirs[i].hash != 0 && set.dirs[i].readable)
+            nb_orphans += print_orphans(&set.dirs[i]);
+    }
+
+    printf("\nResume files: %d (loaded: %d), directories: %zu, missing payloads: %d, "
+           "unresolved payloads: %d, orphaned payloads: %d\n",
+           nb_names, nb_loaded, set.count, nb_missing, nb_unresolved, nb_orphans);
+
+    // Free memory
+    for (i = 0; i < set.capacity; i++) {
+        for (j = 0; j < set.dirs[i].capacity; j++)
+            free(set.dirs[i].entries[j].name);
+        free(set.dirs[i].entries);
+        free(set.dirs[i].path);
+    }
+    free(set.dirs);
+
+    for (i = 0; i < (size_t)nb_names; i++) {
+        free(torrents[i].name);
+        free(torrents[i].destination);
+        free(torrents[i].incomplete_dir);
+        free(names[i]);
+    }
+    free(torrents);
+    free(names);
+
+    return (nb_loaded == nb_names) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,361 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <stdio.h> // fprintf(), perror(), rename()
+#include <stdlib.h> // malloc(), mkstemp(), free()
+#include <string.h> // memcmp(), memcpy(), strlen()
+#include <fcntl.h> // open()
+#include <unistd.h> // ftruncate(), fsync(), close()
+#include <sys/mman.h> // mmap(), msync(), munmap()
+#include <sys/stat.h> // stat(), fchmod()
+
+#include "common.h"
+#include "digest.h"
+#include "io.h"
+#include "index.h"
+#include "trcheck.h"
+
+#define INDEX_MAGIC "TRCKIDX"
+#define INDEX_VERSION 1
+#define INDEX_MIN_CAPACITY 64
+
+/* Updates are never made in place: the index of the previous run is only
+ * read, the new one is built in a unique "<index>.XXXXXX" (mkstemp()) and
+ * atomically renamed over the previous one once synced. A crash leaves the
+ * previous index intact, and a stray "<index>.XXXXXX" to be deleted.
+ */
+struct resume_index {
+    char * path;
+    char * tmp_path;
+    // Previous run (read only, may be NULL)
+    void * old_map;
+    size_t old_map_size;
+    const index_entry * old_entries;
+    uint64_t old_capacity;
+    // This run
+    int fd;
+    void * new_map;
+    size_t new_map_size;
+    index_entry * new_entries;
+    uint64_t new_capacity;
+    uint64_t new_count;
+};
+
+
+static uint64_t index_key(const char name[])
+{
+    /* 0 marks free slots.
+     */
+
+    uint64_t key = digest64(name, strlen(name), 0);
+    return (key != 0) ? key : 1;
+}
+
+
+static void * map_previous_index(const char path[], size_t * map_size, uint64_t * capacity)
+{
+    /* Map the index of the previous run.
+     * Return NULL if there is none or if it is not valid (ignored).
+     */
+
+    struct stat sb;
+    index_header * header;
+    void * map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(index_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    header = map;
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+            || header->version != INDEX_VERSION
+            || header->entry_size != sizeof(index_entry)
+            || header->capacity == 0
+            || (header->capacity & (header->capacity - 1)) != 0
+            || (uint64_t)sb.st_size != sizeof(index_header) + header->capacity * sizeof(index_entry)) {
+        fprintf(stderr, "WARNING: Index '%s' is not valid, it will be rebuilt\n", path);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    *map_size = sb.st_size;
+    *capacity = header->capacity;
+    return map;
+}
+
+
+resume_index * index_open(const char path[], size_t nb_files)
+{
+    /* Open the index of the previous run (if any) and create the new one,
+     * sized for nb_files entries (load factor <= 0.5).
+     * Return NULL on error.
+     */
+
+    resume_index * index;
+
+    index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        PRINT_MEMORY_ERROR()
+        return NULL;
+    }
+
+    index->fd = -1;
+    index->path = strdup(path);
+    index->tmp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+
+    if (index->path == NULL || index->tmp_path == NULL) {
+        PRINT_MEMORY_ERROR()
+        index_abort(index);
+        return NULL;
+    }
+    // Unique name: shards may run concurrently with the same index
+    sprintf(index->tmp_path, "%s.XXXXXX", path);
+
+    index->old_map = map_previous_index(path, &index->old_map_size, &index->old_capacity);
+    if (index->old_map)
+        index->old_entries = (const index_entry *)((const char *)index->old_map + sizeof(index_header));
+
+    index->new_capacity = INDEX_MIN_CAPACITY;
+    while (index->new_capacity < 2 * nb_files)
+        index->new_capacity *= 2;
+
+    index->new_map_size = sizeof(index_header) + index->new_capacity * sizeof(index_entry);
+
+    index->fd = mkstemp(index->tmp_path);
+    if (index->fd == -1) {
+        perror("mkstemp");
+        index_abort(index);
+        return NULL;
+    }
+    fchmod(index->fd, 0644);
+
+    // Sparse file, zeroed: all slots are free
+    if (ftruncate(index->fd, index->new_map_size) == -1) {
+        perror("ftruncate");
+        index_abort(index);
+        return NULL;
+    }
+
+    index->new_map = mmap(NULL, index->new_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+    if (index->new_map == MAP_FAILED) {
+        perror("mmap");
+        index->new_map = NULL;
+        index_abort(index);
+        return NULL;
+    }
+
+    index->new_entries = (index_entry *)((char *)index->new_map + sizeof(index_header));
+    return index;
+}
+
+
+static const index_entry * lookup_previous(const resume_index * index, uint64_t key)
+{
+    uint64_t mask = index->old_capacity - 1;
+    uint64_t slot;
+    uint64_t i;
+
+    if (index->old_map == NULL)
+        return NULL;
+
+    slot = key & mask;
+
+    for (i = 0; i < index->old_capacity; i++) {
+        const index_entry * entry = &index->old_entries[(slot + i) & mask];
+
+        if (entry->key == key)
+            return entry;
+        if (entry->key == 0)
+            return NULL;
+    }
+    return NULL;
+}
+
+
+static int stat_entry(const char path[], const char name[], index_entry * entry)
+{
+    struct stat sb;
+
+    if (stat(path, &sb) == -1) {
+        perror("stat");
+        return -1;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->key = index_key(name);
+    entry->inode = sb.st_ino;
+    entry->size = sb.st_size;
+    entry->mtime_sec = sb.st_mtim.tv_sec;
+    entry->mtime_nsec = sb.st_mtim.tv_nsec;
+    return 0;
+}
+
+
+bool index_is_unchanged(const resume_index * index, const char path[], const char name[],
+                        index_entry * current)
+{
+    /* Tell if the resume file passed the previous checks and did not change since.
+     * Same inode, size and modification time: unchanged without reading it.
+     * Otherwise, same size and same content digest (touched/copied file).
+     * On success, 'current' is ready to be stored in the new index.
+     */
+
+    const index_entry * previous;
+
+    if (stat_entry(path, name, current) == -1)
+        return false;
+
+    previous = lookup_previous(index, current->key);
+
+    if (previous == NULL || previous->verdict != TRC_VERDICT_OK || previous->size != current->size)
+        return false;
+
+    if (previous->inode != current->inode
+            || previous->mtime_sec != current->mtime_sec
+            || previous->mtime_nsec != current->mtime_nsec) {
+
+        if (digest_file(path, &current->digest) == -1 || current->digest != previous->digest)
+            return false;
+    } else {
+        current->digest = previous->digest;
+    }
+
+    current->verdict = TRC_VERDICT_OK;
+    return true;
+}
+
+
+int index_fill_entry(const char path[], const char name[], index_entry * entry)
+{
+    /* Fill the entry of a resume file that was just checked
+     * (the verdict is set by the caller).
+     * Return 0 on success, -1 on error.
+     */
+
+    if (stat_entry(path, name, entry) == -1)
+        return -1;
+
+    return digest_file(path, &entry->digest);
+}
+
+
+bool index_keep_previous(resume_index * index, const char name[])
+{
+    /* Copy the entry of a resume file from the previous index, for files
+     * that are not checked by this run (other shards).
+     * Return false if there is none.
+     */
+
+    const index_entry * previous = lookup_previous(index, index_key(name));
+
+    return previous != NULL && index_store(index, previous);
+}
+
+
+bool index_store(resume_index * index, const index_entry * entry)
+{
+    /* Add or replace an entry in the new index.
+     */
+
+    uint64_t mask = index->new_capacity - 1;
+    uint64_t slot = entry->key & mask;
+
+    while (index->new_entries[slot].key != 0 && index->new_entries[slot].key != entry->key)
+        slot = (slot + 1) & mask;
+
+    if (index->new_entries[slot].key == 0) {
+        // Keep at least one free slot to end the probes
+        if (index->new_count + 1 >= index->new_capacity)
+            return false;
+        index->new_count++;
+    }
+
+    index->new_entries[slot] = *entry;
+    return true;
+}
+
+
+static void close_index(resume_index * index)
+{
+    if (index->new_map)
+        munmap(index->new_map, index->new_map_size);
+    if (index->old_map)
+        munmap(index->old_map, index->old_map_size);
+    if (index->fd != -1)
+        close(index->fd);
+
+    free(index->path);
+    free(index->tmp_path);
+    free(index);
+}
+
+
+int index_commit(resume_index * index)
+{
+    /* Sync the new index and replace the previous one.
+     * Return 0 on success, -1 on error (the previous index is kept).
+     */
+
+    index_header * header = index->new_map;
+
+    memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header->version = INDEX_VERSION;
+    header->entry_size = sizeof(index_entry);
+    header->capacity = index->new_capacity;
+    header->count = index->new_count;
+
+    if (msync(index->new_map, index->new_map_size, MS_SYNC) == -1
+            || fsync(index->fd) == -1
+            || rename(index->tmp_path, index->path) == -1) {
+        perror("index");
+        index_abort(index);
+        return -1;
+    }
+
+    // Persist the rename
+    fsync_parent_dir(index->path);
+
+    close_index(index);
+    return 0;
+}
+
+
+void index_abort(resume_index * index)
+{
+    /* Drop the new index, the previous one is kept.
+     */
+
+    if (index->tmp_path && index->fd != -1)
+        unlink(index->tmp_path);
+
+    close_index(index);
+}
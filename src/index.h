@@ -0,0 +1,61 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_INDEX_H
+#define TR_CHECK_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sidecar index of the resume files that were already checked.
+ * File layout: index_header, then 'capacity' index_entry slots
+ * (open addressing, linear probing, key 0 = free slot).
+ */
+typedef struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t capacity; // power of 2
+    uint64_t count;
+} index_header;
+
+typedef struct index_entry {
+    uint64_t key; // digest of the resume filename
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t digest; // digest of the content
+    uint32_t verdict;
+    uint32_t reserved;
+} index_entry;
+
+typedef struct resume_index resume_index;
+
+resume_index * index_open(const char path[], size_t nb_files);
+bool index_is_unchanged(const resume_index * index, const char path[], const char name[],
+                        index_entry * current);
+int index_fill_entry(const char path[], const char name[], index_entry * entry);
+bool index_keep_previous(resume_index * index, const char name[]);
+bool index_store(resume_index * index, const index_entry * entry);
+int index_commit(resume_index * index);
+void index_abort(resume_index * index);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#define _GNU_SOURCE // O_DIRECT, syscall()
+#include <stdio.h> // perror(), fprintf(), sprintf(), rename()
+#include <stdlib.h> // malloc(), posix_memalign(), free()
+#include <string.h> // memset(), strdup(), strerror(), strlen()
+#include <time.h> // nanosleep()
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <libgen.h> // dirname()
+#include <fcntl.h> // open(), fcntl(), posix_fadvise()
+#include <unistd.h> // read(), write(), fsync(), close(), unlink(), syscall()
+#include <sys/stat.h> // fstat()
+#include <sys/syscall.h> // SYS_ioprio_set
+
+#include "common.h"
+#include "io.h"
+#include "metrics.h"
+
+// Reads of IO_CHUNK bytes, aligned on IO_ALIGN for O_DIRECT
+#define IO_CHUNK (1 << 20)
+#define IO_ALIGN 4096
+// Token bucket: unused transfer time saved for bursts
+#define IO_BURST_NS 100000000ULL
+// AIMD: period of the adjustments, latency of a congested disk, lowest rate
+#define IO_ADJUST_NS 100000000ULL
+#define IO_TARGET_LATENCY_NS 20000000ULL
+#define IO_MIN_RATE_DIV 64
+// linux/ioprio.h is not exported by every distribution
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+io_sched * io_default = NULL;
+
+
+void io_sched_init(io_sched * sched, double max_rate, bool direct)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->max_rate = max_rate;
+    sched->rate = max_rate;
+    sched->tokens = max_rate * IO_BURST_NS / 1e9;
+    sched->direct = direct;
+    sched->last_refill = sched->last_adjust = metrics_now();
+}
+
+
+void io_sched_wait(io_sched * sched, uint64_t cost)
+{
+    /* Token bucket: wait until 'cost' bytes can be transferred at the
+     * current rate. Up to IO_BURST_NS of unused transfer time is saved.
+     */
+
+    uint64_t now = metrics_now();
+    double burst = sched->rate * IO_BURST_NS / 1e9;
+    uint64_t wait;
+    struct timespec delay;
+
+    sched->tokens += (now - sched->last_refill) * sched->rate / 1e9;
+    if (sched->tokens > burst)
+        sched->tokens = burst;
+    sched->last_refill = now;
+
+    sched->bytes += cost;
+    sched->nb_ops++;
+    sched->tokens -= cost;
+
+    if (sched->tokens >= 0)
+        return;
+
+    // The debt is paid by the next refill, which includes this wait
+    wait = -sched->tokens / sched->rate * 1e9;
+    delay.tv_sec = wait / 1000000000;
+    delay.tv_nsec = wait % 1000000000;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+
+    sched->throttled += wait;
+    metrics_stop(STAGE_THROTTLE, now);
+}
+
+
+void io_sched_feedback(io_sched * sched, uint64_t latency)
+{
+    /* AIMD on the observed latency, once per IO_ADJUST_NS: the rate is
+     * halved while the disks are congested (by the daemon), and raised
+     * by 1/16 of the limit otherwise.
+     */
+
+    uint64_t now = metrics_now();
+
+    sched->latency = sched->latency ? (7 * sched->latency + latency) / 8 : latency;
+
+    if (now - sched->last_adjust < IO_ADJUST_NS)
+        return;
+    sched->last_adjust = now;
+
+    if (sched->latency > IO_TARGET_LATENCY_NS) {
+        sched->rate /= 2;
+        if (sched->rate < sched->max_rate / IO_MIN_RATE_DIV)
+            sched->rate = sched->max_rate / IO_MIN_RATE_DIV;
+        sched->nb_slowdowns++;
+    } else {
+        sched->rate += sched->max_rate / 16;
+        if (sched->rate > sched->max_rate)
+            sched->rate = sched->max_rate;
+    }
+}
+
+
+void io_sched_print(const io_sched * sched)
+{
+    fprintf(stderr, "I/O: %" PRIu64 " operations, %.1f MiB, throttled: %.2f s, "
+            "rate: %.1f MiB/s (limit: %.1f MiB/s), slowdowns: %" PRIu64 "\n",
+            sched->nb_ops, sched->bytes / 1048576.0, sched->throttled / 1e9,
+            sched->rate / 1048576.0, sched->max_rate / 1048576.0, sched->nb_slowdowns);
+}
+
+
+int io_set_idle_priority(void)
+{
+    /* Idle I/O class: the disk is only used when no other process needs
+     * it (honored by the CFQ and BFQ elevators).
+     */
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        fprintf(stderr, "WARNING: Idle I/O priority not available: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int read_file(const char path[], uint8_t ** buffer, size_t * len)
+{
+    /* Read the whole content of a (small) file.
+     * With io_default, reads are scheduled, by chunks of IO_CHUNK bytes,
+     * and the pages read are dropped from the page cache (or not cached
+     * at all with O_DIRECT).
+     * Return 0 on success, -1 on error.
+     * The buffer must be freed by the caller.
+     */
+
+    io_sched * sched = io_default;
+    struct stat sb;
+    size_t done = 0, size, chunk;
+    ssize_t nb_read;
+    uint64_t start = 0;
+    bool direct = false;
+    int fd = -1;
+
+    *buffer = NULL;
+
+    if (sched && sched->direct) {
+        // Not supported by every filesystem (tmpfs...): buffered read then
+        fd = open(path, O_RDONLY | O_DIRECT);
+        direct = (fd != -1);
+    }
+
+    if (fd == -1)
+        fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    if (direct) {
+        // Buffer, offsets and sizes of O_DIRECT reads must be aligned
+        size = (sb.st_size + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+        if (posix_memalign((void **)buffer, IO_ALIGN, size > 0 ? size : IO_ALIGN) != 0)
+            *buffer = NULL;
+    } else {
+        size = sb.st_size;
+        *buffer = malloc(size > 0 ? size : 1);
+    }
+
+    if (*buffer == NULL) {
+        PRINT_MEMORY_ERROR()
+        close(fd);
+        return -1;
+    }
+
+    if (sched && !direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (done < (size_t)sb.st_size) {
+        chunk = size - done;
+
+        if (sched) {
+            if (chunk > IO_CHUNK)
+                chunk = IO_CHUNK;
+            io_sched_wait(sched, chunk);
+            start = metrics_now();
+        }
+
+        nb_read = read(fd, *buffer + done, chunk);
+
+        if (sched)
+            io_sched_feedback(sched, metrics_now() - start);
+
+        if (nb_read <= 0) {
+            if (nb_read == -1)
+                perror("read");
+            else
+                fprintf(stderr, "ERROR: '%s' was truncated while reading\n", path);
+            free(*buffer);
+            *buffer = NULL;
+            close(fd);
+            return -1;
+        }
+        done += nb_read;
+
+        // Short O_DIRECT read: the next offset is not aligned, end it buffered
+        if (direct && done % IO_ALIGN != 0 && done < (size_t)sb.st_size) {
+            if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == -1) {
+                perror("fcntl");
+                free(*buffer);
+                *buffer = NULL;
+                close(fd);
+                return -1;
+            }
+            direct = false;
+        }
+    }
+
+    // Leave the page cache to the daemon
+    if (sched && !direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    close(fd);
+    *len = done;
+    return 0;
+}
+
+
+int write_file(const char path[], const uint8_t buffer[], size_t len)
+{
+    /* Replace the content of a (small) file: written next to it, synced,
+     * then renamed over it, so that neither a reader nor a crash leaves
+     * a partial file.
+     * Return 0 on success, -1 on error.
+     */
+
+    char * tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    size_t done = 0;
+    ssize_t nb_written;
+    int fd;
+
+    if (tmp_path == NULL) {
+        PRINT_MEMORY_ERROR()
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        free(tmp_path);
+        return -1;
+    }
+
+    while (done < len) {
+        nb_written = write(fd, buffer + done, len - done);
+
+        if (nb_written == -1) {
+            perror("write");
+            close(fd);
+            unlink(tmp_path);
+            free(tmp_path);
+            return -1;
+        }
+        done += nb_written;
+    }
+
+    // The content must be on disk before the rename makes it visible
+    if (fsync(fd) == -1) {
+        perror("fsync");
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    if (close(fd) == -1 || rename(tmp_path, path) == -1) {
+        perror("write_file");
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    fsync_parent_dir(path);
+    free(tmp_path);
+    return 0;
+}
+
+
+void fsync_parent_dir(const char path[])
+{
+    /* Persist the creation (or rename) of a file.
+     */
+
+    char * dir_path = strdup(path);
+    int dir_fd;
+
+    if (dir_path == NULL)
+        return;
+
+    dir_fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(dir_path);
+}
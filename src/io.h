@@ -0,0 +1,59 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_IO_H
+#define TR_CHECK_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Scheduler of the I/O competing with transmission-daemon (walks of the
+ * downloaded files, reads): token bucket capped at max_rate, rate adapted
+ * to the observed latency, page cache left to the daemon.
+ */
+typedef struct io_sched {
+    double max_rate; // bytes/s
+    double rate; // current rate: max_rate / IO_MIN_RATE_DIV .. max_rate
+    double tokens; // bytes (negative: debt)
+    uint64_t last_refill; // ns
+    uint64_t last_adjust; // ns
+    uint64_t latency; // moving average, ns
+    bool direct; // O_DIRECT reads
+    // Statistics
+    uint64_t bytes;
+    uint64_t nb_ops;
+    uint64_t throttled; // ns
+    uint64_t nb_slowdowns;
+} io_sched;
+
+// Scheduler of read_file() (NULL: unscheduled reads)
+extern io_sched * io_default;
+
+void io_sched_init(io_sched * sched, double max_rate, bool direct);
+void io_sched_wait(io_sched * sched, uint64_t cost);
+void io_sched_feedback(io_sched * sched, uint64_t latency);
+void io_sched_print(const io_sched * sched);
+int io_set_idle_priority(void);
+
+int read_file(const char path[], uint8_t ** buffer, size_t * len);
+int write_file(const char path[], const uint8_t buffer[], size_t len);
+void fsync_parent_dir(const char path[]);
+
+#endif
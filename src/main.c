@@ -23,28 +23,29 @@ Copyright 2016 Ysard
 #include <string.h> // strlen(), strstr(), strcmp()
 #include <stdio.h> // fprintf(), printf()
 #include <stdlib.h> // exit(), EXIT_FAILURE, EXIT_SUCCESS
-#include <time.h> // ctime(), localtime()
-#include <inttypes.h> // http://en.cppreference.com/w/cpp/types/integer - uint64_t on printf()
 #include <sys/types.h>
 #include <sys/stat.h> // stat()
-#include <ftw.h> // ftw()
-#include <regex.h> // regexec(), regerror(), regfree(), regcomp()
-#include <libgen.h> // basename()
-#include <errno.h>
-#include <unistd.h>
 // libtransmission
 #include <libtransmission/transmission.h>
 #include <libtransmission/variant.h>
 #include <libtransmission/tr-getopt.h> // command line parser
 
+#include "common.h"
+#include "compact.h"
+#include "diff.h"
+#include "dir_index.h"
+#include "index.h"
+#include "io.h"
+#include "metrics.h"
+#include "pack.h"
+#include "report.h"
+#include "resume_dir.h"
+#include "shard.h"
+#include "trcheck.h"
+
 #define MY_NAME "transmission-check"
 #define LONG_VERSION_STRING "0.1"
-#define PRINT_MEMORY_ERROR() fprintf(stderr, "ERROR: Insufficient memory\n\n");
-
 
-// Global static variables
-static uint64_t total_size = 0;
-static int nb_repaired_inconsistencies = 0;
 
 // Parameters
 static bool make_changes = false;
@@ -52,11 +53,48 @@ static bool showVersion = false;
 static bool verbose = false;
 static const char * resume_file = NULL;
 static const char * replace[2] = { NULL, NULL };
+static const char * diff_dirs[2] = { NULL, NULL };
+static const char * patch_file = NULL;
+static const char * apply_file = NULL;
+static const char * shard_arg = NULL;
+static const char * report_file = NULL;
+static bool merge = false;
+static bool compact = false;
+static bool orphans = false;
+static bool show_stats = false;
+static bool hw_counters = false;
+static const char * stats_file = NULL;
+static const char * index_file = NULL;
+static const char * pack_file = NULL;
+static const char * unpack_file = NULL;
+static const char * entry_name = NULL;
+static const char * io_limit = NULL;
+static bool direct_io = false;
+static io_sched io_scheduler;
+static const char ** input_files = NULL;
+static int nb_input_files = 0;
 
 static tr_option options[] =
 {
+    { 'a', "apply", "Apply a patch written by --diff to a resume directory (with -m)", "a", 1, "<patch>" },
+    { 'C', "compact", "Rewrite resume files in their minimal form (with -m)", "C", 0, NULL },
+    { 'c', "counters", "With --stats: also read hardware counters (cycles, page faults...)", "c", 0, NULL },
+    { 'D', "direct", "With --io-limit: read files with O_DIRECT (bypass the page cache)", "D", 0, NULL },
+    { 'd', "diff", "Compare two resume directories (joined on the info-hash suffix)", "d", 1, "<dirA> <dirB>" },
+    { 'e', "entry", "With --unpack: only restore this resume file (name or info-hash suffix)", "e", 1, "<name>" },
+    { 'i', "index", "Skip the resume files unchanged since they passed the checks (sidecar index)", "i", 1, "<file>" },
+    { 'k', "pack", "Pack the resume files of a directory into an archive (appended to an existing one)", "k", 1, "<archive>" },
+    { 'l', "io-limit", "Throttle the I/O (walks of the downloaded files, reads) with idle priority", "l", 1, "<MiB/s>" },
     { 'm', "make-changes", "Make changes on resume file", "m", 0, NULL },
+    { 'M', "merge", "Merge the given reports into one", "M", 0, NULL },
+    { 'O', "orphans", "Resolve the downloaded files of a resume directory and list the orphaned ones", "O", 0, NULL },
+    { 'o', "report", "Write a mergeable report of the checks of a resume directory", "o", 1, "<file>" },
     { 'r', "replace", "Search and replace a substring in the filepath", "r", 1, "<old> <new>" },
+    { 'p', "patch", "With --diff: write a patch turning dirA into dirB", "p", 1, "<file>" },
+    { 'P', "stats-file", "Write the stage timings as a Prometheus textfile at exit", "P", 1, "<file>" },
+    { 's', "shard", "Only check the i-th of N slices of a resume directory (0 <= i < N)", "s", 1, "<i/N>" },
+    { 'S', "stats", "Print the stage timings (p50/p99/max) at exit", "S", 0, NULL },
+    { 'u', "unpack", "Restore the resume files of an archive into a directory (with -m)", "u", 1, "<archive>" },
     { 'v', "verbose", "Display informations about resume file", "v", 0, NULL },
     { 'V', "version", "Show version number and exit", "V", 0, NULL },
     { 0, NULL, NULL, NULL, 0, NULL }
@@ -65,7 +103,12 @@ static tr_option options[] =
 
 static const char * getUsage (void)
 {
-    return "Usage: " MY_NAME " [options] resume-file";
+    return "Usage: " MY_NAME " [options] resume-file|resume-dir\n"
+           "       " MY_NAME " -M [-o merged-report] report...\n"
+           "       " MY_NAME " -d dirA dirB [-p patch]\n"
+           "       " MY_NAME " -a patch [-m] resume-dir\n"
+           "       " MY_NAME " -k archive resume-dir\n"
+           "       " MY_NAME " -u archive [-e name] [-m] resume-dir";
 }
 
 
@@ -77,14 +120,72 @@ static int parseCommandLine (int argc, const char ** argv)
     int c;
     const char * optarg;
 
+    input_files = malloc(argc * sizeof(*input_files));
+    if (input_files == NULL) {
+        PRINT_MEMORY_ERROR()
+        exit(EXIT_FAILURE);
+    }
+
     while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
     {
         switch (c)
         {
+        case 'a':
+            apply_file = optarg;
+            break;
+
+        case 'C':
+            compact = true;
+            break;
+
+        case 'c':
+            hw_counters = true;
+            break;
+
+        case 'D':
+            direct_io = true;
+            break;
+
+        case 'd':
+            diff_dirs[0] = optarg;
+            c = tr_getopt (getUsage (), argc, argv, options, &optarg);
+            if (c != TR_OPT_UNK)
+                return 1;
+            diff_dirs[1] = optarg;
+            break;
+
+        case 'e':
+            entry_name = optarg;
+            break;
+
+        case 'i':
+            index_file = optarg;
+            break;
+
+        case 'k':
+            pack_file = optarg;
+            break;
+
+        case 'l':
+            io_limit = optarg;
+            break;
+
         case 'm':
             make_changes = true;
             break;
 
+        case 'M':
+            merge = true;
+            break;
+
+        case 'O':
+            orphans = true;
+            break;
+
+        case 'o':
+            report_file = optarg;
+            break;
+
         case 'r':
             replace[0] = optarg;
             c = tr_getopt (getUsage (), argc, argv, options, &optarg);
@@ -93,6 +194,26 @@ static int parseCommandLine (int argc, const char ** argv)
             replace[1] = optarg;
             break;
 
+        case 'p':
+            patch_file = optarg;
+            break;
+
+        case 'P':
+            stats_file = optarg;
+            break;
+
+        case 's':
+            shard_arg = optarg;
+            break;
+
+        case 'S':
+            show_stats = true;
+            break;
+
+        case 'u':
+            unpack_file = optarg;
+            break;
+
         case 'v':
             verbose = true;
             break;
@@ -102,9 +223,7 @@ static int parseCommandLine (int argc, const char ** argv)
             break;
 
         case TR_OPT_UNK:
-            if (resume_file != NULL)
-                return 1;
-            resume_file = optarg;
+            input_files[nb_input_files++] = optarg;
             break;
 
         default:
@@ -112,684 +231,259 @@ static int parseCommandLine (int argc, const char ** argv)
         }
     }
 
-    return 0;
-}
-
-
-int is_file_or_dir_exists(const char *path)
-{
-    /* Detect if the given file/directory exists.
-     * Return 0 if does not exist or if the type is unknown/not supported.
-     * Return 1,2 or 3 if exists and is a directory, symlink or regular file.
-     */
-
-    struct stat info;
-    int err = 0;
-
-    // On success, zero is returned. On error, -1 is returned, and errno is set appropriately.
-    err = stat(path, &info);
-
-    if(err == -1) {
-        if(errno == ENOENT) {
-            /* does not exist */
-            return 0;
-        } else {
-            perror("stat");
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    // directory : info.st_mode & S_IFDIR
-    switch (info.st_mode & S_IFMT) {
-    case S_IFDIR:  printf("Directory found... ");        return 1;
-    case S_IFLNK:  printf("Symlink found... ");          return 2;
-    case S_IFREG:  printf("Regular file found... ");     return 3;
-    default:       printf("Unknown type?\n");            return 0;
-    }
+    // Only merges accept several files
+    if (nb_input_files > 1 && !merge)
+        return 1;
 
-    return 0;
-}
+    if (nb_input_files > 0)
+        resume_file = input_files[0];
 
-
-int sum_sizes(const char *fpath __attribute__((unused)), const struct stat *sb, int typeflag __attribute__((unused)))
-{
-    /* Callback for ftw() function.
-     * Calculate the size of the given file and increment static 'total_size' variable.
-     */
-
-    total_size += sb->st_size;
     return 0;
 }
 
 
-void check_uploaded_files(char ** full_path)
+trc_verdict process_resume_file(const char path[])
 {
-    /* Test the existence of the given file/directory.
-     * Calculate the size.
+    /* Check, repair or update one resume file according to the parameters.
      */
 
-    int err = 0;
-
-    if (is_file_or_dir_exists(*full_path) > 0) {
-
-        err = ftw(*full_path, &sum_sizes, 1);
+    trc_ctx ctx;
+    trc_verdict verdict;
 
-        if (err == -1) {
-            perror("ftw");
-            free(full_path);
-            exit(EXIT_FAILURE);
-        }
+    trc_init(&ctx, NULL);
+    ctx.make_changes = make_changes;
+    ctx.verbose = verbose;
+    ctx.io = io_default;
 
-    } else {
-        fprintf(stderr, "ERROR: Uploaded file/directory '%s' not found !\n", *full_path);
-        free(*full_path);
-        exit(EXIT_FAILURE);
-    }
+    // Show parameters (verbose mode)
+    if (verbose)
+        printf("Parameters: show version: %d, make changes: %d, resume file: %s,  replace old: %s, replace new: %s\n",
+               showVersion, make_changes, path, replace[0], replace[1]);
 
-    printf("Total bytes: %" PRIu64 "\n", total_size);
+    trc_check_file(&ctx, path, replace[0], replace[1], &verdict);
+    return verdict;
 }
 
 
-void get_uploaded_files_path(tr_variant * top, char ** full_path)
+int check_resume_dir(const char dir_path[], const shard_spec * shard)
 {
-    /* Compute the full path of file/directory downloaded by the torrent.
+    /* Check (or compact) every resume file of the directory that belongs
+     * to the given shard.
+     * With an index, files unchanged since they passed the previous
+     * checks are skipped.
      */
 
-    char * tmp_ptr = NULL;
-    size_t len;
-    const char * str;
-
-    // Concatenate paths dynamically.
-    if ((tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
-            && (str && *str))
-    {
-        //printf("TR_KEY_destination %s, %zu\n", str, len);
-
-        *full_path = malloc((len + 1) * sizeof(**full_path));
-
-        if (*full_path) {
-            strcpy(*full_path, str);
-            //printf("dir path: %s, %zu\n", *full_path, strlen(*full_path));
-
-            if (tr_variantDictFindStr (top, TR_KEY_name, &str, &len))
-            {
-                //printf("TR_KEY_name %s, %zu\n", str, len);
-
-                // Temp pointer
-                // length of previous string + length of added string + length if '/' + '\0'
-                tmp_ptr = realloc(*full_path, (strlen(*full_path) + len + 2) * sizeof(**full_path));
-
-                if (tmp_ptr == NULL) {
-                    // Free memory
-                    free(*full_path);
-                    exit(EXIT_FAILURE);
-                } else {
-                    *full_path = tmp_ptr;
-                }
-
-                strcat(*full_path, "/");
-                strncat(*full_path, str, len);
-
-                //printf("full path: %s\n", *full_path);
-                return;
-
-            } else {
-                fprintf(stderr, "ERROR: Resume file: TR_KEY_name could not be read !\n");
+    char ** names = NULL;
+    int nb_names;
+    int nb_verdicts[TRC_VERDICT_COUNT] = { 0 };
+    int nb_unchanged = 0;
+    FILE * report = NULL;
+    resume_index * index = NULL;
+    index_entry entry;
+    compact_totals totals = { 0 };
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    nb_names = list_resume_files(dir_path, &names);
+    if (nb_names == -1)
+        return EXIT_FAILURE;
 
-                // On error, deallocate the memory
-                free(*full_path);
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            PRINT_MEMORY_ERROR()
-            exit(EXIT_FAILURE);
+    if (report_file) {
+        report = report_open(report_file, shard);
+        if (report == NULL) {
+            ret = EXIT_FAILURE;
+            goto cleanup;
         }
-
-    } else {
-        fprintf(stderr, "ERROR: Resume file: TR_KEY_destination could not be read !\n");
     }
-}
 
-
-void update_dates(tr_variant * top, char date_name[], const tr_quark date_type,
-                  int64_t old_timestamp, time_t new_timestamp,
-                  bool force_date_update, bool make_changes)
-{
-    /* Update the dates according to the given parameters:
-     * old_timestamp is replaced by new_timestamp
-     * if make_changes is true:
-     * and date is erroneous
-     * or force_date_update is true
-     *
-     * The date type (key in tr_variant dict is given by 'date_type';
-     * the name of the manipulated date is given by the string 'date_name'.
-     *
-     * In case of replacement, new date is the last file modification date.
-     */
-
-    struct tm instant;
-
-    instant = *localtime((time_t*)&old_timestamp);
-    // printf("%s date: %s %" PRIu64 "\n", date_name, ctime(&old_timestamp), old_timestamp);
-
-    // Change date if it is Erroneous or if force_date_update is set to true
-    if (instant.tm_year + 1900 == 1970 || force_date_update) {
-
-        if (make_changes) {
-            tr_variantDictAddInt(top, date_type, new_timestamp);
-            printf("REPAIR: Erroneous %s date: Updated to modification date: %s", date_name, ctime((time_t*)&new_timestamp));
-
-            nb_repaired_inconsistencies++;
-        } else {
-            // Just inform that an erroneous date was encountered...
-            printf("Erroneous %s date detected !\n", date_name);
+    if (index_file) {
+        index = index_open(index_file, nb_names);
+        if (index == NULL) {
+            if (report)
+                fclose(report);
+            ret = EXIT_FAILURE;
+            goto cleanup;
         }
     }
-}
 
+    for (i = 0; i < nb_names; i++) {
+        trc_verdict verdict;
+        char * path;
 
-void check_dates(tr_variant * top, char ** full_path, bool force_date_update, bool make_changes)
-{
-    /* Try to resolve date problems (incorrect/corrupted dates)
-     * On error => update the field with last file modification date.
-     */
-
-    struct stat sb;
-    int err = 0;
-    int64_t  old_timestamp;
+        if (!is_in_shard(names[i], shard)) {
+            // Checked by another shard: its entry is kept
+            if (index)
+                index_keep_previous(index, names[i]);
+            continue;
+        }
 
-    err = stat(*full_path, &sb);
+        path = join_path(dir_path, names[i]);
 
-    if(err == -1) {
-        perror("stat");
-        free(*full_path);
-        exit(EXIT_FAILURE);
-    }
+        if (index && index_is_unchanged(index, path, names[i], &entry)) {
+            // Passed the previous checks, not modified since
+            index_store(index, &entry);
+            nb_unchanged++;
+            nb_verdicts[TRC_VERDICT_OK]++;
 
-    /*
-    printf("Last status change:       %s", ctime(&sb.st_ctime));
-    printf("Last file access:         %s", ctime(&sb.st_atime));
-    printf("Last file modification:   %s", ctime(&sb.st_mtime));
-    */
+            if (report)
+                report_add(report, names[i], TRC_VERDICT_OK);
 
-    if (tr_variantDictFindInt (top, TR_KEY_added_date, &old_timestamp))
-    {
-        update_dates(top, "added", TR_KEY_added_date,
-                     old_timestamp, sb.st_mtime,
-                     force_date_update, make_changes);
-    }
+            free(path);
+            continue;
+        }
 
-    if (tr_variantDictFindInt (top, TR_KEY_done_date, &old_timestamp))
-    {
-        update_dates(top, "done", TR_KEY_done_date,
-                     old_timestamp, sb.st_mtime,
-                     force_date_update, make_changes);
-    }
-}
+        printf("\n>>> %s\n", names[i]);
 
+        if (compact)
+            verdict = compact_resume_file(path, make_changes, &totals);
+        else
+            verdict = process_resume_file(path);
 
-void reset_peers(tr_variant * top)
-{
-    /* Reset peers in the resume file.
-     */
+        nb_verdicts[verdict]++;
 
-    size_t len;
-    const uint8_t * str_8;
+        if (report)
+            report_add(report, names[i], verdict);
 
-    if (tr_variantDictFindRaw (top, TR_KEY_peers2, &str_8, &len))
-    {
-        // reinit peers
-        tr_variantDictAddRaw (top, TR_KEY_peers2, NULL, 0);
-    }
+        // Keep the state of the file after the checks (and repairs)
+        if (index && index_fill_entry(path, names[i], &entry) == 0) {
+            entry.verdict = verdict;
+            index_store(index, &entry);
+        }
 
-    if (tr_variantDictFindRaw (top, TR_KEY_peers2_6, &str_8, &len))
-    {
-        // reinit peers
-        tr_variantDictAddRaw (top, TR_KEY_peers2_6, NULL, 0);
+        free(path);
     }
 
-    printf("REPAIR: Peers cleared.\n");
-}
-
-
-void check_correct_files_pointed(tr_variant * top, const char resume_filename[])
-{
-    /* Verify if file/directory of the torrent matches the resume filename.
-     * If not, we try to infer the original name from the name of the resume filename.
-     * In this case, nb_repaired_inconsistencies is incremented.
-     * Note: If nb_repaired_inconsistencies is incremented here,
-     * full_path variable must be updated with the new inferred file
-     * (and we have to verify of the inferred file exists).
-     * Note: Since corrupted resume files get their dates from the bad pointed file,
-     * dates must also be updated, even if they are correct (above 1970 ...).
-     */
-
-    size_t len;
-    int err = 0;
-    regex_t preg;
-    const char * actual_file;
-    const char * regex_suffix = "\\.([[:lower:][:digit:]]{16})\\.resume$";
+    printf("\nShard %u/%u:", shard->index, shard->count);
+    for (i = 0; i < TRC_VERDICT_COUNT; i++)
+        printf(" %s: %d", trc_verdict_to_str(i), nb_verdicts[i]);
+    if (index)
+        printf(" (unchanged, skipped: %d)", nb_unchanged);
+    printf("\n");
 
+    if (compact)
+        print_compact_totals(&totals);
 
-    // Get file downloaded
-    tr_variantDictFindStr(top, TR_KEY_name, &actual_file, &len);
-    //printf("%s VS %s\n", actual_file, resume_filename);
-
-    // No pb in file names
-    if(strstr(resume_filename, actual_file) != NULL) {
-        //printf("File/directory name matches !\n");
-        return;
+    if (index && index_commit(index) != 0) {
+        fprintf(stderr, "ERROR: Index '%s' could not be saved !\n", index_file);
+        ret = EXIT_FAILURE;
     }
 
+    if (report && report_close(report, nb_verdicts) != EXIT_SUCCESS)
+        ret = EXIT_FAILURE;
 
-    printf("REPAIR: Resume file does not point to the correct file/directory !\n");
-    printf("REPAIR: Trying to resolve inconsistencies...\n");
-
-
-    err = regcomp (&preg, regex_suffix, REG_EXTENDED);
-
-    if (err == 0) {
-
-        int match;
-        size_t nmatch = 0;
-        regmatch_t *pmatch = NULL;
-
-        nmatch = preg.re_nsub;
-        pmatch = malloc (sizeof (*pmatch) * nmatch);
-
-        // Now, we know that there are nmatch matches.
-        if (pmatch) {
-
-            match = regexec (&preg, resume_filename, nmatch, pmatch, 0);
-            regfree (&preg);
-
-            if (match == 0) {
-
-                char * inferred_file = NULL;
-                int start = pmatch[0].rm_so;
-                //int end = pmatch[0].rm_eo;
-                //size_t size = end - start;
-                //char * suffix = NULL;
-                /*
-                suffix = malloc (sizeof (*suffix) * (size + 1));
-
-                if (suffix != NULL) {
-                    strncpy(suffix, &resume_filename[start], size);
-                    suffix[size] = '\0';
-                    printf("suffix %s\n", suffix);
-                    free(suffix);
-                }
-                */
-
-                //printf("suffix found at position %d\n", start);
-                //printf("%s\n", resume_filename);
-
-                // get [0;x] included, where x is the position of the first character of the suffix
-                inferred_file = malloc (sizeof (*inferred_file) * (start + 1));
-
-                if (inferred_file) {
-                    strncpy(inferred_file, &resume_filename[0], start);
-                    inferred_file[start] = '\0';
-
-                    printf("REPAIR: Inferred file: %s\n", inferred_file);
-
-                    // Update the resume file
-                    tr_variantDictAddStr(top, TR_KEY_name, inferred_file);
-                    nb_repaired_inconsistencies++;
-
-                    // Deallocate memory
-                    free(inferred_file);
-                } else {
-                    PRINT_MEMORY_ERROR()
-                    exit(EXIT_FAILURE);
-                }
+    if (nb_verdicts[TRC_VERDICT_ERROR] > 0)
+        ret = EXIT_FAILURE;
 
-            } else if (match == REG_NOMATCH) {
-                fprintf(stderr, "ERROR: Resume file has an incorrect name !\n");
-                exit(EXIT_FAILURE);
-
-            } else {
-                // Regex error handling
-
-                char *text;
-                size_t size;
-
-                size = regerror(err, &preg, NULL, 0);
-                text = malloc(sizeof (*text) * size);
-
-                if (text) {
-
-                    regerror(err, &preg, text, size);
-                    fprintf(stderr, "ERROR: Regex: %s\n", text);
-
-                    // Free memory
-                    free(text);
-
-                } else {
-                    PRINT_MEMORY_ERROR()
-                    exit(EXIT_FAILURE);
-                }
-            }
-            // Free memory
-            free(pmatch);
-        } else {
-            PRINT_MEMORY_ERROR()
-            exit(EXIT_FAILURE);
-        }
-    }
+cleanup:
+    for (i = 0; i < nb_names; i++)
+        free(names[i]);
+    free(names);
+    return ret;
 }
 
 
-void replace_dir(tr_variant * top, const char old[], const char new[])
+int check_pack(const char archive_path[], const shard_spec * shard)
 {
-    /* Replace old substring in path by the new string
+    /* Check the resume files stored in an archive, without unpacking it.
+     * The archive is read only: inconsistencies are reported, not repaired.
      */
 
-    size_t len;
-    const char * str;
-    char * start = NULL;
-    char * new_path = NULL;
-
-
-    // Concatenate paths dynamically.
-    if ((tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
-            && (str && *str))
-    {
-
-        start = strstr(str, old);
-        /* printf("original dest: %s\n", str);
-         * printf("addr: %d %c\n", start, *start);
-         * printf("addr+1: %d, %c\n", start+1, *(start+1));
-         * printf("original dest index 0: %d, %c\n", str, str[0]);
-         * printf("suffix start addr: %d, %c\n", start+strlen(old), *(start+strlen(old)));
-         * printf("suffix end addr: %d, %c\n", str + strlen(str), *(str + strlen(str)));
-         * printf("alloc size %d\n", strlen(str) - strlen(old) + strlen(new) + 1);
-         */
-
-        if(start) {
-
-            size_t prefix_length = start - str;
-            char * suffix_start_addr = start + strlen(old);
-
-            new_path = calloc((strlen(str) - strlen(old) + strlen(new) + 1), sizeof(*new_path));
-
-            if (new_path) {
-                // Add prefix
-                strncpy(new_path, str, prefix_length);
-                // Add new string
-                strcat(new_path, new);
-                // Add suffix
-                strcat(new_path, suffix_start_addr);
-
-                // Update the resume file
-                tr_variantDictAddStr(top, TR_KEY_destination, new_path);
-                printf("UPDATE: New path: %s\n", new_path);
-
-                nb_repaired_inconsistencies++;
-                free(new_path);
-            } else {
-                PRINT_MEMORY_ERROR()
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            fprintf(stderr, "ERROR: Substring '%s' not found in '%s'\n", old, str);
-        }
-    }
-}
-
-
-void read_resume_file(tr_variant * top)
-{
-    /* Display informations taken from the resume file.
-     * Note: This is not exhaustive.
-     */
-
-    size_t len;
-    int64_t  i;
-    const char * str;
-    tr_variant * dict;
-    bool boolVal;
-
-
-    printf("\n==============================\n");
-    printf("   Resume file informations   \n");
-    printf("==============================\n\n");
-
-    // Directories/files
-    if ((tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
-            && (str && *str))
-    {
-        printf("TR_KEY_destination %s\n", str);
-    }
-
-    if ((tr_variantDictFindStr (top, TR_KEY_incomplete_dir, &str, &len))
-            && (str && *str))
-    {
-        printf("TR_KEY_incomplete_dir %s\n", str);
-    }
-
-    if (tr_variantDictFindStr (top, TR_KEY_name, &str, NULL))
-    {
-        printf("TR_KEY_name %s\n", str);
-    }
-
-    // DL/UP stats & state
-    if (tr_variantDictFindInt (top, TR_KEY_downloaded, &i))
-    {
-        printf("TR_KEY_downloaded %" PRIu64 "\n", i);
-    }
-
-    if (tr_variantDictFindInt (top, TR_KEY_uploaded, &i))
-    {
-        printf("TR_KEY_uploaded %" PRIu64 "\n", i);
-    }
-
-    if (tr_variantDictFindBool (top, TR_KEY_paused, &boolVal))
-    {
-        printf("TR_KEY_paused %d\n", boolVal);
-    }
-
-    if (tr_variantDictFindInt (top, TR_KEY_seeding_time_seconds, &i))
-    {
-        printf("TR_KEY_seeding_time_seconds %" PRIu64 "\n", i);
-    }
-
-    if (tr_variantDictFindInt (top, TR_KEY_downloading_time_seconds, &i))
-    {
-        printf("TR_KEY_downloading_time_seconds %" PRIu64 "\n", i);
-    }
-
-    // Timestamped informations
-    if (tr_variantDictFindInt (top, TR_KEY_added_date, &i))
-    {
-        printf("TR_KEY_added_date %" PRIu64 ": %s", i, ctime((time_t*)&i));
-    }
-
-    if (tr_variantDictFindInt (top, TR_KEY_done_date, &i))
-    {
-        printf("TR_KEY_done_date %" PRIu64 ": %s", i, ctime((time_t*)&i));
-    }
-
-    if (tr_variantDictFindInt (top, TR_KEY_activity_date, &i))
-    {
-        printf("TR_KEY_activity_date %" PRIu64 ": %s", i, ctime((time_t*)&i));
-    }
-
-
-
-    if (tr_variantDictFindInt (top, TR_KEY_bandwidth_priority, &i)
-            /*&& tr_isPriority (i)*/)
-    {
-        printf("TR_KEY_bandwidth_priority %" PRIu64 "\n", i);
-    }
+    pack_archive * archive;
+    const pack_entry ** entries;
+    const uint8_t * data;
+    int nb_entries;
+    int nb_verdicts[TRC_VERDICT_COUNT] = { 0 };
+    FILE * report = NULL;
+    trc_ctx ctx;
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    archive = pack_open(archive_path);
+    if (archive == NULL)
+        return EXIT_FAILURE;
 
-    // Limits (speed & peers)
-    if (tr_variantDictFindInt (top, TR_KEY_max_peers, &i))
-    {
-        printf("TR_KEY_max_peers %" PRIu64 "\n", i);
+    nb_entries = pack_verify_index(archive) ? pack_entries(archive, &entries) : -1;
+    if (nb_entries == -1) {
+        pack_close(archive);
+        return EXIT_FAILURE;
     }
 
-    if (tr_variantDictFindDict (top, TR_KEY_speed_limit_up, &dict))
-    {
-        printf("Speed limit up:\n");
-
-        if (tr_variantDictFindInt (dict, TR_KEY_speed_Bps, &i))
-        {
-            printf("\tTR_KEY_speed_Bps %" PRIu64 "\n", i);
+    if (report_file) {
+        report = report_open(report_file, shard);
+        if (report == NULL) {
+            ret = EXIT_FAILURE;
+            goto cleanup;
         }
-        else if (tr_variantDictFindInt (dict, TR_KEY_speed, &i))
-            printf("\tTR_KEY_speed %" PRIu64 "\n", i*1024);
-
-        if (tr_variantDictFindBool (dict, TR_KEY_use_speed_limit, &boolVal))
-            printf("\tTR_KEY_use_speed_limit %d\n", boolVal);
-
-        if (tr_variantDictFindBool (dict, TR_KEY_use_global_speed_limit, &boolVal))
-            printf("\tTR_KEY_use_global_speed_limit %d\n", boolVal);
     }
 
-    if (tr_variantDictFindDict (top, TR_KEY_speed_limit_down, &dict))
-    {
-        printf("Speed limit down:\n");
+    trc_init(&ctx, NULL);
+    ctx.verbose = verbose;
+    ctx.io = io_default;
 
-        if (tr_variantDictFindInt (dict, TR_KEY_speed_Bps, &i))
-        {
-            printf("\tTR_KEY_speed_Bps %" PRIu64 "\n", i);
-        }
-        else if (tr_variantDictFindInt (dict, TR_KEY_speed, &i))
-            printf("\tTR_KEY_speed %" PRIu64 "\n", i*1024);
+    for (i = 0; i < nb_entries; i++) {
+        const char * name = pack_entry_name(archive, entries[i]);
+        trc_verdict verdict = TRC_VERDICT_ERROR;
 
-        if (tr_variantDictFindBool (dict, TR_KEY_use_speed_limit, &boolVal))
-            printf("\tTR_KEY_use_speed_limit %d\n", boolVal);
+        if (!is_in_shard(name, shard))
+            continue;
 
-        if (tr_variantDictFindBool (dict, TR_KEY_use_global_speed_limit, &boolVal))
-            printf("\tTR_KEY_use_global_speed_limit %d\n", boolVal);
-    }
+        printf("\n>>> %s\n", name);
 
-    // Peers list
-    const uint8_t * str_8;
+        data = pack_entry_data(archive, entries[i]);
+        if (data)
+            trc_check_buffer(&ctx, data, entries[i]->length, name, &verdict);
 
-    if (tr_variantDictFindRaw (top, TR_KEY_peers2, &str_8, &len))
-    {
-        printf("TR_KEY_peers2 %zu bytes\n", len);
-    }
+        nb_verdicts[verdict]++;
 
-    if (tr_variantDictFindRaw (top, TR_KEY_peers2_6, &str_8, &len))
-    {
-        printf("TR_KEY_peers2_6 %zu bytes\n", len);
+        if (report)
+            report_add(report, name, verdict);
     }
 
+    printf("\nShard %u/%u:", shard->index, shard->count);
+    for (i = 0; i < TRC_VERDICT_COUNT; i++)
+        printf(" %s: %d", trc_verdict_to_str(i), nb_verdicts[i]);
+    printf("\n");
 
-    /* Fields not supported (yet)
-     i **f (fieldsToLoad & TR_FR_PEERS)
-     fieldsLoaded |= loadPeers (top, tor);
-
-     i *f (fieldsToLoad & TR_FR_FILE_PRIORITIES)
-     fieldsLoaded |= loadFilePriorities (top, tor);
-
-     if (fieldsToLoad & TR_FR_PROGRESS)
-         fieldsLoaded |= loadProgress (top, tor);
-
-     if (fieldsToLoad & TR_FR_DND)
-         fieldsLoaded |= loadDND (top, tor);
-
-     if (fieldsToLoad & TR_FR_RATIOLIMIT)
-         fieldsLoaded |= loadRatioLimits (top, tor);
-
-     if (fieldsToLoad & TR_FR_IDLELIMIT)
-         fieldsLoaded |= loadIdleLimits (top, tor);
-
-     if (fieldsToLoad & TR_FR_FILENAMES)
-         fieldsLoaded |= loadFilenames (top, tor);
-
-     if (fieldsToLoad & TR_FR_NAME)
-         fieldsLoaded |= loadName (top, tor);
-     */
-
-    /*
-    tr_variant * list;
+    if (report && report_close(report, nb_verdicts) != EXIT_SUCCESS)
+        ret = EXIT_FAILURE;
 
-    if (tr_variantDictFindList (top, TR_KEY_files, &list))
-    {
-        size_t i;
-        const size_t n = tr_variantListSize (list);
-        printf("TR_KEY_files found\n");
+    if (nb_verdicts[TRC_VERDICT_ERROR] > 0)
+        ret = EXIT_FAILURE;
 
-        for (i=0; i<n; ++i)
-        {
-            //const char * str;
-            size_t str_len;
-            if (tr_variantGetStr (tr_variantListChild (list, i), &str, &str_len) && str && str_len)
-            {
-                printf("TR_KEY_files %s\n", str);
-            }
-        }
-    }
-    */
+cleanup:
+    free(entries);
+    pack_close(archive);
+    return ret;
 }
 
 
-void repair_resume_file(tr_variant * top, char resume_filename[], bool make_changes)
+bool init_io_scheduler(void)
 {
-    /* Repair entry point
+    /* Schedule the I/O at the given rate, with the idle I/O priority.
      */
 
-    printf("\n==============================\n");
-    printf("        Repair attempts       \n");
-    printf("==============================\n\n");
-
-
-    bool force_date_update = false;
-    char * full_path = NULL;
-
-    // Get the path of downloaded files
-    get_uploaded_files_path(top, &full_path);
-    printf("Full path: %s\n", full_path);
-
-    // Verify if file/directory of the torrent matches the resume filename
-    check_correct_files_pointed(top, resume_filename);
+    char * end;
+    double limit = strtod(io_limit, &end);
 
-    // Here we know if pointed files were ok or not (nb_repaired_inconsistencies > 0)
-    // If not, we update the full path and plan to force the update of dates
-    // with the dates of the new directory
-    if (nb_repaired_inconsistencies > 0) {
-        // Free memory
-        free(full_path);
-
-        // Get new full path
-        get_uploaded_files_path(top, &full_path);
-        printf("REPAIR: New full path: %s\n", full_path);
-
-        // Force update of dates
-        force_date_update = true;
+    if (*end != '\0' || !(limit > 0)) {
+        fprintf(stderr, "ERROR: Invalid I/O limit '%s', expected a rate in MiB/s !\n", io_limit);
+        return false;
     }
 
-    // Check existence of downloaded files
-    check_uploaded_files(&full_path);
-
-    // Check dates
-    check_dates(top, &full_path, force_date_update, make_changes);
-
-    // If there are inconsistencies, the file is corrupted => cleaning step
-    // Reset peers list
-    if ((nb_repaired_inconsistencies > 0) && make_changes)
-        reset_peers(top);
+    io_sched_init(&io_scheduler, limit * 1048576, direct_io);
+    io_default = &io_scheduler;
 
-    // What was done according to make_changes value
-    if (make_changes)
-        printf("Repaired inconsistencies: %d\n", nb_repaired_inconsistencies);
-    else
-        printf("Repaired inconsistencies: 0\n");
-
-    // Free memory
-    free(full_path);
+    // Not fatal: the token bucket still applies
+    io_set_idle_priority();
+    return true;
 }
 
 
 int main (int argc, char ** argv)
 {
-    char * resume_filename = NULL;
-    tr_variant top;
-    int err;
+    struct stat sb;
+    shard_spec shard = { 0, 1 };
+    int ret;
 
 
     if (parseCommandLine (argc, (const char**)argv))
@@ -801,6 +495,38 @@ int main (int argc, char ** argv)
         return EXIT_SUCCESS;
     }
 
+    if (hw_counters && !(show_stats || stats_file)) {
+        fprintf(stderr, "ERROR: --counters requires --stats or --stats-file !\n");
+        return EXIT_FAILURE;
+    }
+
+    if (patch_file && !diff_dirs[0]) {
+        fprintf(stderr, "ERROR: --patch requires --diff !\n");
+        return EXIT_FAILURE;
+    }
+
+    // Stage timings of every mode, reported at exit
+    if ((show_stats || stats_file) && !metrics_init(hw_counters, stats_file))
+        return EXIT_FAILURE;
+
+    // Throttled I/O for the boxes in production
+    if (io_limit && !init_io_scheduler())
+        return EXIT_FAILURE;
+
+    if (direct_io && !io_limit) {
+        fprintf(stderr, "ERROR: --direct requires --io-limit !\n");
+        return EXIT_FAILURE;
+    }
+
+    // Compare two resume directories
+    if (diff_dirs[0]) {
+        ret = diff_resume_dirs(diff_dirs[0], diff_dirs[1], patch_file);
+        if (io_default)
+            io_sched_print(io_default);
+        free(input_files);
+        return ret;
+    }
+
     if (resume_file == NULL)
     {
         fprintf (stderr, "ERROR: No resume file specified.\n");
@@ -809,49 +535,84 @@ int main (int argc, char ** argv)
         return EXIT_FAILURE;
     }
 
-
-    // Load the resume file in memory
-    if (tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, resume_file))
-    {
-        fprintf(stderr, "ERROR: Resume file could not be opened !\n");
-        exit(EXIT_FAILURE);
+    // Merge partial reports
+    if (merge) {
+        ret = merge_reports(input_files, nb_input_files, report_file);
+        free(input_files);
+        return ret;
     }
 
-
-    // Load data from resume file & show parameters (verbose mode)
-    if (verbose) {
-        printf("Parameters: show version: %d, make changes: %d, resume file: %s,  replace old: %s, replace new: %s\n",
-               showVersion, make_changes, resume_file, replace[0], replace[1]);
-        read_resume_file(&top);
+    if (shard_arg && !parse_shard_spec(shard_arg, &shard)) {
+        fprintf(stderr, "ERROR: Invalid shard '%s', expected <i/N> with 0 <= i < N !\n", shard_arg);
+        return EXIT_FAILURE;
     }
 
-    // Repair or replace directory ?
-    if (replace[0] == NULL) {
-        // Get the basename of the resume file
-        resume_filename = basename((char*)resume_file); // cast to non-const
-        //printf("resume file: %s\n", resume_filename);
+    if (index_file && (replace[0] || compact)) {
+        fprintf(stderr, "ERROR: --index can not be used with --replace or --compact !\n");
+        return EXIT_FAILURE;
+    }
 
-        // Repair attempts
-        repair_resume_file(&top, resume_filename, make_changes);
-    } else {
-        // Replace directory
-        replace_dir(&top, replace[0], replace[1]);
+    if (compact && replace[0]) {
+        fprintf(stderr, "ERROR: --compact can not be used with --replace !\n");
+        return EXIT_FAILURE;
     }
 
+    if ((pack_file || unpack_file)
+            && (shard_arg || report_file || index_file || compact || replace[0] || orphans || apply_file)) {
+        fprintf(stderr, "ERROR: --pack and --unpack can not be used with other modes !\n");
+        return EXIT_FAILURE;
+    }
 
-    // Write the resume file if inconsistencies are repaired, and if changes are allowed
-    if (nb_repaired_inconsistencies > 0 && make_changes)
-    {
-        if ((err = tr_variantToFile(&top, TR_VARIANT_FMT_BENC, resume_file)))
-            fprintf(stderr, "ERROR: While saving the new .resume file\n");
-        else
-            printf("The file was successfully modified.\n");
+    if (entry_name && !unpack_file) {
+        fprintf(stderr, "ERROR: --entry requires --unpack !\n");
+        return EXIT_FAILURE;
+    }
 
+    if (pack_file) {
+        // Whole directory in one archive
+        ret = pack_resume_dir(resume_file, pack_file);
+    } else if (unpack_file) {
+        ret = unpack_archive(unpack_file, resume_file, entry_name, make_changes);
+    } else if (apply_file) {
+        // Patch written by --diff
+        ret = apply_patch(apply_file, resume_file, make_changes);
+    } else if (orphans) {
+        // Batch resolution of the downloaded files, needs the whole directory
+        if (stat(resume_file, &sb) == -1 || !S_ISDIR(sb.st_mode)) {
+            fprintf(stderr, "ERROR: --orphans requires a resume directory !\n");
+            ret = EXIT_FAILURE;
+        } else if (shard_arg || report_file || index_file || compact || replace[0]) {
+            fprintf(stderr, "ERROR: --orphans can not be used with other modes !\n");
+            ret = EXIT_FAILURE;
+        } else {
+            ret = find_orphans(resume_file);
+        }
+    } else if (stat(resume_file, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        // Check a whole resume directory (or a shard of it)
+        ret = check_resume_dir(resume_file, &shard);
+    } else if (is_pack_file(resume_file)) {
+        // Check an archive written by --pack (or a shard of it)
+        if (index_file || compact || replace[0] || make_changes) {
+            fprintf(stderr, "ERROR: Archives are checked read only (unpack them to use -m, -r, -C or -i) !\n");
+            ret = EXIT_FAILURE;
+        } else {
+            ret = check_pack(resume_file, &shard);
+        }
+    } else if (shard_arg || report_file || index_file) {
+        fprintf(stderr, "ERROR: --shard, --report and --index require a resume directory !\n");
+        ret = EXIT_FAILURE;
+    } else if (compact) {
+        compact_totals totals = { 0 };
+
+        ret = (compact_resume_file(resume_file, make_changes, &totals) == TRC_VERDICT_ERROR) ? EXIT_FAILURE : EXIT_SUCCESS;
+        print_compact_totals(&totals);
     } else {
-        printf("The file remains untouched.\n");
+        ret = (process_resume_file(resume_file) == TRC_VERDICT_ERROR) ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
-    // Free memory
-    tr_variantFree (&top);
-    exit(EXIT_SUCCESS);
+    if (io_default)
+        io_sched_print(io_default);
+
+    free(input_files);
+    return ret;
 }
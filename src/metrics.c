@@ -0,0 +1,327 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#define _GNU_SOURCE // syscall()
+#include <stdio.h> // fprintf(), fopen(), rename()
+#include <stdlib.h> // atexit(), calloc()
+#include <string.h> // memset()
+#include <time.h> // clock_gettime()
+#include <unistd.h> // syscall()
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <sys/syscall.h> // SYS_perf_event_open
+#include <linux/perf_event.h> // struct perf_event_attr
+
+#include "common.h"
+#include "metrics.h"
+
+/* Log-linear histograms: values below 2^SUB_BITS ns have their own
+ * bucket; above, each power of 2 is split in 2^SUB_BITS buckets
+ * (relative error < 1/2^SUB_BITS, 6% here).
+ */
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define NB_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct stage_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[NB_BUCKETS];
+} stage_histogram;
+
+enum { HW_CYCLES, HW_PAGE_FAULTS, HW_CONTEXT_SWITCHES, HW_COUNT };
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char * name;
+    const char * help;
+} hw_counters[HW_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cpu_cycles", "CPU cycles (user space)" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults", "Page faults" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches", "Context switches" },
+};
+
+static const char * stage_names[STAGE_COUNT] = {
+    [STAGE_RUN] = "run",
+    [STAGE_FILE] = "file",
+    [STAGE_LOAD] = "load",
+    [STAGE_REPAIR] = "repair",
+    [STAGE_WALK] = "walk",
+    [STAGE_STAT] = "stat",
+    [STAGE_SAVE] = "save",
+    [STAGE_THROTTLE] = "throttle",
+};
+
+bool metrics_enabled = false;
+
+static stage_histogram * histograms = NULL;
+static int perf_fds[HW_COUNT] = { -1, -1, -1 };
+static const char * prometheus_file = NULL;
+static uint64_t run_start = 0;
+
+
+uint64_t metrics_now(void)
+{
+    /* Monotonic clock in nanoseconds.
+     */
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int bucket_index(uint64_t value)
+{
+    int exponent;
+
+    if (value < SUB_COUNT)
+        return value;
+
+    exponent = 63 - __builtin_clzll(value);
+    return (exponent - SUB_BITS + 1) * SUB_COUNT
+           + ((value >> (exponent - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+
+static uint64_t bucket_upper_bound(int index)
+{
+    int group, shift;
+
+    if (index < SUB_COUNT)
+        return index;
+
+    group = index / SUB_COUNT;
+    shift = group - 1;
+    return (((uint64_t)(SUB_COUNT + index % SUB_COUNT) << shift) + ((uint64_t)1 << shift)) - 1;
+}
+
+
+void metrics_record(metrics_stage stage, uint64_t duration_ns)
+{
+    stage_histogram * h = &histograms[stage];
+
+    if (h->count == 0 || duration_ns < h->min)
+        h->min = duration_ns;
+    if (duration_ns > h->max)
+        h->max = duration_ns;
+
+    h->count++;
+    h->sum += duration_ns;
+    h->buckets[bucket_index(duration_ns)]++;
+}
+
+
+static uint64_t percentile(const stage_histogram * h, double quantile)
+{
+    /* Upper bound of the bucket holding the given quantile (capped by max).
+     */
+
+    uint64_t rank = (uint64_t)(quantile * h->count + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < NB_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return (bucket_upper_bound(i) < h->max) ? bucket_upper_bound(i) : h->max;
+    }
+    return h->max;
+}
+
+
+static bool read_hw_counter(int counter, uint64_t * value)
+{
+    if (perf_fds[counter] == -1)
+        return false;
+
+    return read(perf_fds[counter], value, sizeof(*value)) == sizeof(*value);
+}
+
+
+static void print_summary(void)
+{
+    uint64_t value;
+    int i;
+
+    fprintf(stderr, "\n%-8s %8s %12s %12s %12s %12s\n",
+            "Stage", "Count", "p50 (us)", "p99 (us)", "Max (us)", "Total (us)");
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        const stage_histogram * h = &histograms[i];
+
+        if (h->count == 0)
+            continue;
+
+        fprintf(stderr, "%-8s %8" PRIu64 " %12.1f %12.1f %12.1f %12.1f\n",
+                stage_names[i], h->count,
+                percentile(h, 0.5) / 1e3, percentile(h, 0.99) / 1e3,
+                h->max / 1e3, h->sum / 1e3);
+    }
+
+    for (i = 0; i < HW_COUNT; i++) {
+        if (read_hw_counter(i, &value))
+            fprintf(stderr, "%s: %" PRIu64 "\n", hw_counters[i].help, value);
+    }
+}
+
+
+static int write_prometheus_file(const char path[])
+{
+    /* Write the metrics in the Prometheus text format.
+     * The file is renamed at the end, so that a collector never reads a
+     * partial file (node_exporter textfile collector).
+     */
+
+    char * tmp_path;
+    FILE * out;
+    uint64_t value;
+    int i;
+
+    tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp_path == NULL)
+        return -1;
+    sprintf(tmp_path, "%s.tmp", path);
+
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror("fopen");
+        free(tmp_path);
+        return -1;
+    }
+
+    fprintf(out, "# HELP transmission_check_stage_duration_seconds Duration of the stages of the checks.\n");
+    fprintf(out, "# TYPE transmission_check_stage_duration_seconds summary\n");
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        const stage_histogram * h = &histograms[i];
+
+        if (h->count > 0) {
+            fprintf(out, "transmission_check_stage_duration_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n",
+                    stage_names[i], percentile(h, 0.5) / 1e9);
+            fprintf(out, "transmission_check_stage_duration_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n",
+                    stage_names[i], percentile(h, 0.99) / 1e9);
+        }
+        fprintf(out, "transmission_check_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+                stage_names[i], h->sum / 1e9);
+        fprintf(out, "transmission_check_stage_duration_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+                stage_names[i], h->count);
+    }
+
+    fprintf(out, "# HELP transmission_check_stage_duration_max_seconds Longest duration of the stages of the checks.\n");
+    fprintf(out, "# TYPE transmission_check_stage_duration_max_seconds gauge\n");
+
+    for (i = 0; i < STAGE_COUNT; i++)
+        fprintf(out, "transmission_check_stage_duration_max_seconds{stage=\"%s\"} %.9f\n",
+                stage_names[i], histograms[i].max / 1e9);
+
+    for (i = 0; i < HW_COUNT; i++) {
+        if (!read_hw_counter(i, &value))
+            continue;
+
+        fprintf(out, "# HELP transmission_check_%s_total %s.\n", hw_counters[i].name, hw_counters[i].help);
+        fprintf(out, "# TYPE transmission_check_%s_total counter\n", hw_counters[i].name);
+        fprintf(out, "transmission_check_%s_total %" PRIu64 "\n", hw_counters[i].name, value);
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+        perror("metrics");
+        free(tmp_path);
+        return -1;
+    }
+
+    free(tmp_path);
+    return 0;
+}
+
+
+static void metrics_report(void)
+{
+    /* atexit() handler.
+     */
+
+    metrics_stop(STAGE_RUN, run_start);
+
+    if (prometheus_file) {
+        if (write_prometheus_file(prometheus_file) != 0)
+            fprintf(stderr, "ERROR: Metrics could not be written to '%s'\n", prometheus_file);
+    } else {
+        print_summary();
+    }
+}
+
+
+static void open_hw_counters(void)
+{
+    /* Counters of this process (and of its threads: inherit).
+     * They are often restricted (perf_event_paranoid): just warn.
+     */
+
+    struct perf_event_attr attr;
+    int i;
+
+    for (i = 0; i < HW_COUNT; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = hw_counters[i].type;
+        attr.config = hw_counters[i].config;
+        attr.inherit = 1;
+        // Software events (faults, switches) are counted by the kernel
+        attr.exclude_kernel = (attr.type == PERF_TYPE_HARDWARE);
+        attr.exclude_hv = 1;
+
+        perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+        if (perf_fds[i] == -1)
+            fprintf(stderr, "WARNING: %s counter not available: %s\n",
+                    hw_counters[i].help, strerror(errno));
+    }
+}
+
+
+bool metrics_init(bool hw_counters_enabled, const char textfile[])
+{
+    /* Enable the instrumentation; results are printed on stderr at exit,
+     * or written to 'textfile' if not NULL.
+     */
+
+    histograms = calloc(STAGE_COUNT, sizeof(*histograms));
+
+    if (histograms == NULL) {
+        PRINT_MEMORY_ERROR()
+        return false;
+    }
+
+    if (hw_counters_enabled)
+        open_hw_counters();
+
+    prometheus_file = textfile;
+    metrics_enabled = true;
+    run_start = metrics_now();
+
+    atexit(metrics_report);
+    return true;
+}
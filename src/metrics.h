@@ -0,0 +1,59 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_METRICS_H
+#define TR_CHECK_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Stages timed by the instrumentation (see --stats).
+ */
+typedef enum metrics_stage {
+    STAGE_RUN,      // whole process
+    STAGE_FILE,     // one resume file: load, checks, save
+    STAGE_LOAD,     // tr_variantFromFile(), tr_variantFromBenc()
+    STAGE_REPAIR,   // trc_repair()
+    STAGE_WALK,     // ftw() in check_uploaded_files()
+    STAGE_STAT,     // stat() in check_dates()
+    STAGE_SAVE,     // tr_variantToFile()
+    STAGE_THROTTLE, // waits of the I/O scheduler (see --io-limit)
+    STAGE_COUNT
+} metrics_stage;
+
+extern bool metrics_enabled;
+
+uint64_t metrics_now(void);
+void metrics_record(metrics_stage stage, uint64_t duration_ns);
+bool metrics_init(bool hw_counters, const char textfile[]);
+
+/* Cheap when the instrumentation is off: one predictable branch.
+ */
+static inline uint64_t metrics_start(void)
+{
+    return metrics_enabled ? metrics_now() : 0;
+}
+
+static inline void metrics_stop(metrics_stage stage, uint64_t start)
+{
+    if (metrics_enabled)
+        metrics_record(stage, metrics_now() - start);
+}
+
+#endif
@@ -0,0 +1,678 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <stdio.h> // printf(), fprintf(), perror(), sprintf(), rename()
+#include <stdlib.h> // calloc(), malloc(), free(), qsort(), EXIT_FAILURE, EXIT_SUCCESS
+#include <string.h> // memcmp(), memcpy(), memset(), strcmp(), strlen()
+#include <stddef.h> // offsetof()
+#include <inttypes.h> // PRIu64
+#include <fcntl.h> // open()
+#include <unistd.h> // pwrite(), fsync(), close(), unlink()
+#include <sys/mman.h> // mmap(), madvise(), munmap()
+#include <sys/stat.h> // fstat()
+
+#include "common.h"
+#include "digest.h"
+#include "io.h"
+#include "pack.h"
+#include "resume_dir.h"
+#include "shard.h"
+
+#define PACK_MAGIC "TRCKPAK"
+#define PACK_VERSION 1
+#define PACK_MIN_CAPACITY 64
+#define PACK_ALIGN 8
+// Size of the writes: thousands of small resume files per write() call
+#define PACK_CHUNK (1 << 20)
+
+struct pack_archive {
+    void * map;
+    size_t map_size;
+    const pack_header * header;
+    const pack_entry * slots;
+    const char * names;
+    uint64_t names_size;
+};
+
+// Buffered sequential writer
+typedef struct pack_writer {
+    int fd;
+    uint8_t * buffer;
+    size_t used;
+    uint64_t offset; // of the first byte of the buffer in the file
+} pack_writer;
+
+
+static uint64_t pack_key(const char name[])
+{
+    /* 0 marks free slots.
+     */
+
+    size_t len;
+    const char * key = resume_join_key(name, &len);
+    uint64_t digest = digest64(key, len, 0);
+
+    return (digest != 0) ? digest : 1;
+}
+
+
+static uint64_t header_digest(const pack_header * header)
+{
+    return digest64(header, offsetof(pack_header, header_digest), 0);
+}
+
+
+static bool is_valid_entry(const pack_header * header, const pack_entry * entry,
+                           const char names[], uint64_t names_size)
+{
+    /* Blobs are located before the index, names inside it.
+     */
+
+    return entry->offset >= sizeof(pack_header)
+        && entry->offset <= header->index_offset
+        && entry->length <= header->index_offset - entry->offset
+        && entry->name_offset < names_size
+        && entry->name_len < names_size - entry->name_offset
+        && names[entry->name_offset + entry->name_len] == '\0';
+}
+
+
+bool is_pack_file(const char path[])
+{
+    /* Detect an archive from its magic.
+     */
+
+    char magic[sizeof(PACK_MAGIC)];
+    FILE * file = fopen(path, "rb");
+    bool found;
+
+    if (file == NULL)
+        return false;
+
+    found = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+            && memcmp(magic, PACK_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return found;
+}
+
+
+pack_archive * pack_open(const char path[])
+{
+    /* Map an archive (read only) and validate its header.
+     * The index is not read: the slots are validated when they are probed
+     * (see pack_verify_index() for the whole index).
+     * Return NULL on error.
+     */
+
+    pack_archive * archive;
+    const pack_header * header;
+    struct stat sb;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return NULL;
+    }
+
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    if ((size_t)sb.st_size < sizeof(pack_header)) {
+        fprintf(stderr, "ERROR: '%s' is not a valid archive !\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    archive = calloc(1, sizeof(*archive));
+    if (archive == NULL) {
+        PRINT_MEMORY_ERROR()
+        close(fd);
+        return NULL;
+    }
+
+    archive->map_size = sb.st_size;
+    archive->map = mmap(NULL, archive->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (archive->map == MAP_FAILED) {
+        perror("mmap");
+        free(archive);
+        return NULL;
+    }
+
+    header = archive->header = archive->map;
+
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0
+            || header->version != PACK_VERSION
+            || header->entry_size != sizeof(pack_entry)
+            || header->header_digest != header_digest(header)
+            || header->capacity == 0
+            || (header->capacity & (header->capacity - 1)) != 0
+            // At least one free slot: the probes end
+            || header->count >= header->capacity
+            || header->index_offset < sizeof(pack_header)
+            || header->index_offset > archive->map_size
+            || header->index_size > archive->map_size - header->index_offset
+            || header->capacity > header->index_size / sizeof(pack_entry)) {
+        fprintf(stderr, "ERROR: '%s' is not a valid archive !\n", path);
+        pack_close(archive);
+        return NULL;
+    }
+
+    archive->slots = (const pack_entry *)((const uint8_t *)archive->map + header->index_offset);
+    archive->names = (const char *)(archive->slots + header->capacity);
+    archive->names_size = header->index_size - header->capacity * sizeof(pack_entry);
+
+    return archive;
+}
+
+
+bool pack_verify_index(const pack_archive * archive)
+{
+    /* Validate the whole index (digest and slots), before going through
+     * all the entries. Lookups with pack_find() do not need it.
+     */
+
+    const pack_header * header = archive->header;
+    uint64_t count = 0, i;
+
+    if (header->index_digest != digest64(archive->slots, header->index_size, 0)) {
+        fprintf(stderr, "ERROR: The index of the archive is corrupted !\n");
+        return false;
+    }
+
+    for (i = 0; i < header->capacity; i++) {
+        if (archive->slots[i].key == 0)
+            continue;
+
+        if (!is_valid_entry(header, &archive->slots[i], archive->names, archive->names_size)) {
+            fprintf(stderr, "ERROR: The index of the archive is corrupted !\n");
+            return false;
+        }
+        count++;
+    }
+
+    if (count != header->count) {
+        fprintf(stderr, "ERROR: The index of the archive is corrupted !\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+void pack_close(pack_archive * archive)
+{
+    if (archive == NULL)
+        return;
+
+    munmap(archive->map, archive->map_size);
+    free(archive);
+}
+
+
+static int compare_offsets(const void * a, const void * b)
+{
+    const pack_entry * entry_a = *(const pack_entry * const *)a;
+    const pack_entry * entry_b = *(const pack_entry * const *)b;
+
+    return (entry_a->offset > entry_b->offset) - (entry_a->offset < entry_b->offset);
+}
+
+
+int pack_entries(const pack_archive * archive, const pack_entry *** entries)
+{
+    /* List the entries of the archive in the order of their blobs
+     * (sequential reads; the order of the names for a new archive).
+     * The index must have been validated by pack_verify_index().
+     * Return the number of entries, or -1 on error.
+     * The array must be freed by the caller.
+     */
+
+    uint64_t i;
+    int nb_entries = 0;
+
+    *entries = malloc((archive->header->count + 1) * sizeof(**entries));
+    if (*entries == NULL) {
+        PRINT_MEMORY_ERROR()
+        return -1;
+    }
+
+    for (i = 0; i < archive->header->capacity; i++) {
+        if (archive->slots[i].key != 0)
+            (*entries)[nb_entries++] = &archive->slots[i];
+    }
+
+    qsort(*entries, nb_entries, sizeof(**entries), compare_offsets);
+    return nb_entries;
+}
+
+
+const char * pack_entry_name(const pack_archive * archive, const pack_entry * entry)
+{
+    return archive->names + entry->name_offset;
+}
+
+
+const uint8_t * pack_entry_data(const pack_archive * archive, const pack_entry * entry)
+{
+    /* Return the content of a resume file of the archive,
+     * or NULL if it does not match its digest.
+     */
+
+    const uint8_t * data = (const uint8_t *)archive->map + entry->offset;
+
+    // Pages of the mapping read by the digest
+    if (io_default)
+        io_sched_wait(io_default, entry->length);
+
+    if (digest64(data, entry->length, 0) != entry->digest) {
+        fprintf(stderr, "ERROR: '%s' is corrupted in the archive !\n", pack_entry_name(archive, entry));
+        return NULL;
+    }
+
+    return data;
+}
+
+
+const pack_entry * pack_find(const pack_archive * archive, const char name[])
+{
+    /* Find a resume file from its name or from its info-hash suffix.
+     * Resume files with the same suffix: the one with the exact name,
+     * the first one otherwise.
+     * The probed slots are validated (their blob is checked when read).
+     * Return NULL if not found.
+     */
+
+    uint64_t key = pack_key(name);
+    uint64_t mask = archive->header->capacity - 1;
+    uint64_t slot = key & mask;
+    uint64_t nb_probes;
+    const pack_entry * found = NULL;
+    size_t len, entry_len;
+    const char * join_key = resume_join_key(name, &len);
+    const char * entry_join_key;
+    const char * entry_name;
+
+    for (nb_probes = 0; nb_probes < archive->header->capacity && archive->slots[slot].key != 0; nb_probes++) {
+        if (archive->slots[slot].key == key) {
+            if (!is_valid_entry(archive->header, &archive->slots[slot],
+                                archive->names, archive->names_size)) {
+                fprintf(stderr, "ERROR: The index of the archive is corrupted !\n");
+                return NULL;
+            }
+            entry_name = pack_entry_name(archive, &archive->slots[slot]);
+
+            if (strcmp(entry_name, name) == 0)
+                return &archive->slots[slot];
+
+            entry_join_key = resume_join_key(entry_name, &entry_len);
+            if (found == NULL && entry_len == len && memcmp(entry_join_key, join_key, len) == 0)
+                found = &archive->slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return found;
+}
+
+
+static int writer_flush(pack_writer * writer)
+{
+    size_t done = 0;
+    ssize_t nb_written;
+
+    while (done < writer->used) {
+        nb_written = pwrite(writer->fd, writer->buffer + done, writer->used - done,
+                            writer->offset + done);
+        if (nb_written == -1) {
+            perror("pwrite");
+            return -1;
+        }
+        done += nb_written;
+    }
+
+    writer->offset += writer->used;
+    writer->used = 0;
+    return 0;
+}
+
+
+static int writer_append(pack_writer * writer, const void * data, size_t len)
+{
+    const uint8_t * bytes = data;
+    size_t size;
+
+    while (len > 0) {
+        if (writer->used == PACK_CHUNK && writer_flush(writer) != 0)
+            return -1;
+
+        size = PACK_CHUNK - writer->used;
+        if (size > len)
+            size = len;
+
+        memcpy(writer->buffer + writer->used, bytes, size);
+        writer->used += size;
+        bytes += size;
+        len -= size;
+    }
+    return 0;
+}
+
+
+static int writer_align(pack_writer * writer)
+{
+    static const uint8_t padding[PACK_ALIGN] = { 0 };
+    uint64_t position = writer->offset + writer->used;
+
+    return writer_append(writer, padding, (PACK_ALIGN - position % PACK_ALIGN) % PACK_ALIGN);
+}
+
+
+int pack_resume_dir(const char dir_path[], const char archive_path[])
+{
+    /* Pack the resume files of a directory.
+     * If the archive exists, only the new or modified resume files are
+     * appended, followed by the new index. The previous index stays valid
+     * until the header is rewritten, after a sync: a crash leaves the
+     * previous version of the archive.
+     */
+
+    pack_archive * previous = NULL;
+    pack_writer writer = { -1, NULL, 0, 0 };
+    pack_header header;
+    pack_entry * slots;
+    char * names_area;
+    uint8_t * index = NULL;
+    char * tmp_path = NULL;
+    char ** names = NULL;
+    uint64_t capacity = PACK_MIN_CAPACITY;
+    uint64_t names_size = 0, name_offset = 0, live_bytes = 0, appended_bytes = 0;
+    uint64_t index_size, count = 0;
+    int nb_names, nb_appended = 0, nb_unchanged = 0, nb_errors = 0;
+    int ret = EXIT_FAILURE;
+    int i;
+
+    nb_names = list_resume_files(dir_path, &names);
+    if (nb_names == -1)
+        return EXIT_FAILURE;
+
+    // Load factor <= 0.5
+    while (capacity < 2 * (uint64_t)nb_names)
+        capacity *= 2;
+
+    for (i = 0; i < nb_names; i++)
+        names_size += strlen(names[i]) + 1;
+
+    index_size = capacity * sizeof(pack_entry) + names_size;
+    index = calloc(1, index_size);
+    writer.buffer = malloc(PACK_CHUNK);
+
+    if (index == NULL || writer.buffer == NULL) {
+        PRINT_MEMORY_ERROR()
+        goto cleanup;
+    }
+    slots = (pack_entry *)index;
+    names_area = (char *)(slots + capacity);
+
+    if (access(archive_path, F_OK) == 0) {
+        // Append to the existing archive
+        previous = pack_open(archive_path);
+        if (previous == NULL || !pack_verify_index(previous)) {
+            fprintf(stderr, "ERROR: Remove '%s' or pack to another file !\n", archive_path);
+            goto cleanup;
+        }
+
+        writer.fd = open(archive_path, O_WRONLY);
+        writer.offset = previous->map_size;
+    } else {
+        // New archive, renamed once complete
+        tmp_path = malloc(strlen(archive_path) + sizeof(".tmp"));
+        if (tmp_path == NULL) {
+            PRINT_MEMORY_ERROR()
+            goto cleanup;
+        }
+        sprintf(tmp_path, "%s.tmp", archive_path);
+
+        writer.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        memset(&header, 0, sizeof(header));
+        writer_append(&writer, &header, sizeof(header));
+    }
+
+    if (writer.fd == -1) {
+        perror("open");
+        goto cleanup;
+    }
+
+    for (i = 0; i < nb_names; i++) {
+        const pack_entry * previous_entry = NULL;
+        pack_entry entry;
+        uint64_t slot;
+        uint8_t * data;
+        size_t len;
+        char * path = join_path(dir_path, names[i]);
+
+        if (read_file(path, &data, &len) != 0) {
+            fprintf(stderr, "ERROR: '%s' could not be packed !\n", path);
+            nb_errors++;
+            free(path);
+            continue;
+        }
+        free(path);
+
+        entry.key = pack_key(names[i]);
+        entry.length = len;
+        entry.digest = digest64(data, len, 0);
+        entry.name_offset = name_offset;
+        entry.name_len = strlen(names[i]);
+
+        if (previous) {
+            previous_entry = pack_find(previous, names[i]);
+            if (previous_entry
+                    && (strcmp(pack_entry_name(previous, previous_entry), names[i]) != 0
+                        || previous_entry->length != entry.length
+                        || previous_entry->digest != entry.digest))
+                previous_entry = NULL;
+        }
+
+        if (previous_entry) {
+            // Unchanged: the blob is shared with the previous index
+            entry.offset = previous_entry->offset;
+            nb_unchanged++;
+        } else {
+            if (writer_align(&writer) != 0) {
+                free(data);
+                goto cleanup;
+            }
+            entry.offset = writer.offset + writer.used;
+
+            if (writer_append(&writer, data, len) != 0) {
+                free(data);
+                goto cleanup;
+            }
+            appended_bytes += len;
+            nb_appended++;
+        }
+        free(data);
+
+        memcpy(names_area + name_offset, names[i], entry.name_len + 1);
+        name_offset += entry.name_len + 1;
+        live_bytes += len;
+
+        slot = entry.key & (capacity - 1);
+        while (slots[slot].key != 0)
+            slot = (slot + 1) & (capacity - 1);
+        slots[slot] = entry;
+        count++;
+    }
+
+    // Index (the names of the skipped files stay unused)
+    if (writer_align(&writer) != 0)
+        goto cleanup;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.entry_size = sizeof(pack_entry);
+    header.capacity = capacity;
+    header.count = count;
+    header.index_offset = writer.offset + writer.used;
+    header.index_size = index_size;
+    header.index_digest = digest64(index, index_size, 0);
+    header.header_digest = header_digest(&header);
+
+    if (writer_append(&writer, index, index_size) != 0
+            || writer_flush(&writer) != 0)
+        goto cleanup;
+
+    // Blobs and index must be on disk before the header points to them
+    if (fsync(writer.fd) == -1
+            || pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header)
+            || fsync(writer.fd) == -1) {
+        perror("archive");
+        goto cleanup;
+    }
+
+    if (tmp_path) {
+        if (rename(tmp_path, archive_path) == -1) {
+            perror("rename");
+            goto cleanup;
+        }
+        fsync_parent_dir(archive_path);
+        free(tmp_path);
+        tmp_path = NULL;
+    }
+
+    printf("PACK: %d files (%d appended, %d unchanged), errors: %d\n",
+           nb_appended + nb_unchanged, nb_appended, nb_unchanged, nb_errors);
+    printf("PACK: %" PRIu64 " bytes written, archive: %" PRIu64 " bytes (%" PRIu64 " bytes of resume files)\n",
+           appended_bytes + index_size + sizeof(header), header.index_offset + index_size, live_bytes);
+
+    ret = (nb_errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+cleanup:
+    if (writer.fd != -1)
+        close(writer.fd);
+    if (tmp_path) {
+        unlink(tmp_path);
+        free(tmp_path);
+    }
+    pack_close(previous);
+    free(writer.buffer);
+    free(index);
+    for (i = 0; i < nb_names; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+
+static int unpack_entry(const pack_archive * archive, const pack_entry * entry,
+                        const char dir_path[], bool make_changes)
+{
+    /* Restore one resume file.
+     * Return 0 on success, -1 on error.
+     */
+
+    const char * name = pack_entry_name(archive, entry);
+    const uint8_t * data;
+    char * path;
+    int ret = 0;
+
+    if (!is_safe_name(name)) {
+        fprintf(stderr, "ERROR: Invalid archive entry '%s' !\n", name);
+        return -1;
+    }
+
+    data = pack_entry_data(archive, entry);
+    if (data == NULL)
+        return -1;
+
+    printf("UNPACK: %s (%" PRIu64 " bytes)\n", name, entry->length);
+
+    if (make_changes) {
+        path = join_path(dir_path, name);
+        ret = write_file(path, data, entry->length);
+        free(path);
+    }
+
+    return ret;
+}
+
+
+int unpack_archive(const char archive_path[], const char dir_path[], const char name[],
+                   bool make_changes)
+{
+    /* Restore the resume files of an archive in a directory, or only the
+     * given one (name or info-hash suffix).
+     * Files are only written if make_changes is true.
+     */
+
+    pack_archive * archive;
+    const pack_entry ** entries;
+    const pack_entry * entry;
+    int nb_entries, nb_unpacked = 0, nb_errors = 0;
+    int i;
+
+    archive = pack_open(archive_path);
+    if (archive == NULL)
+        return EXIT_FAILURE;
+
+    if (name) {
+        // Single restore: one lookup in the index
+        entry = pack_find(archive, name);
+
+        if (entry == NULL) {
+            fprintf(stderr, "ERROR: '%s' not found in the archive !\n", name);
+            nb_errors++;
+        } else if (unpack_entry(archive, entry, dir_path, make_changes) == 0) {
+            nb_unpacked++;
+        } else {
+            nb_errors++;
+        }
+    } else {
+        nb_entries = pack_verify_index(archive) ? pack_entries(archive, &entries) : -1;
+        if (nb_entries == -1) {
+            pack_close(archive);
+            return EXIT_FAILURE;
+        }
+
+        madvise(archive->map, archive->map_size, MADV_SEQUENTIAL);
+
+        for (i = 0; i < nb_entries; i++) {
+            if (unpack_entry(archive, entries[i], dir_path, make_changes) == 0)
+                nb_unpacked++;
+            else
+                nb_errors++;
+        }
+        free(entries);
+    }
+
+    pack_close(archive);
+
+    printf("\nUnpacked files: %d, errors: %d\n", nb_unpacked, nb_errors);
+    if (!make_changes)
+        printf("The files remain untouched (use -m to restore them).\n");
+
+    return (nb_errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
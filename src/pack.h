@@ -0,0 +1,70 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_PACK_H
+#define TR_CHECK_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Single-file archive of a resume directory.
+ * File layout: pack_header, the resume files (raw blobs, 8-byte aligned),
+ * then the index: 'capacity' pack_entry slots (open addressing, linear
+ * probing on the info-hash suffix, key 0 = free slot) followed by the
+ * null-terminated names.
+ * The archive is append-only: packing again appends the new or modified
+ * blobs and a new index; the header is rewritten last to point to it.
+ */
+typedef struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t capacity; // power of 2
+    uint64_t count;
+    uint64_t index_offset;
+    uint64_t index_size; // slots and names
+    uint64_t index_digest;
+    uint64_t header_digest; // digest of the fields above
+} pack_header;
+
+typedef struct pack_entry {
+    uint64_t key; // digest of the info-hash suffix (of the name if there is none)
+    uint64_t offset;
+    uint64_t length;
+    uint64_t digest; // digest of the blob
+    uint64_t name_offset; // in the names of the index
+    uint64_t name_len;
+} pack_entry;
+
+typedef struct pack_archive pack_archive;
+
+bool is_pack_file(const char path[]);
+pack_archive * pack_open(const char path[]);
+void pack_close(pack_archive * archive);
+bool pack_verify_index(const pack_archive * archive);
+int pack_entries(const pack_archive * archive, const pack_entry *** entries);
+const pack_entry * pack_find(const pack_archive * archive, const char name[]);
+const char * pack_entry_name(const pack_archive * archive, const pack_entry * entry);
+const uint8_t * pack_entry_data(const pack_archive * archive, const pack_entry * entry);
+int pack_resume_dir(const char dir_path[], const char archive_path[]);
+int unpack_archive(const char archive_path[], const char dir_path[], const char name[],
+                   bool make_changes);
+
+#endif
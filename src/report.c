@@ -0,0 +1,357 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#define _GNU_SOURCE // getline()
+#include <stdio.h> // fprintf(), fopen(), getline()
+#include <stdlib.h> // malloc(), realloc(), qsort(), EXIT_FAILURE, EXIT_SUCCESS
+#include <string.h> // strchr(), strcmp(), strncmp()
+#include <stdbool.h>
+
+#include "common.h"
+#include "report.h"
+
+/* Report format (one line per resume file, tab separated):
+ *
+ *     # transmission-check report <i>/<N>
+ *     <suffix>\t<verdict>\t<resume filename>
+ *     ...
+ *     # total: ...
+ *
+ * Lines starting with '#' other than the header are comments.
+ * A merged report uses '*' as shard index; it can be merged again.
+ */
+#define REPORT_HEADER "# transmission-check report "
+
+typedef struct report_entry {
+    char * line; // owns the memory of suffix and filename
+    const char * suffix;
+    const char * filename;
+    trc_verdict verdict;
+} report_entry;
+
+
+static bool verdict_from_str(const char str[], trc_verdict * verdict)
+{
+    int i;
+
+    for (i = 0; i < TRC_VERDICT_COUNT; i++) {
+        if (strcmp(str, trc_verdict_to_str(i)) == 0) {
+            *verdict = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+FILE * report_open(const char path[], const shard_spec * shard)
+{
+    /* Create a report file and write its header.
+     * Return NULL on error.
+     */
+
+    FILE * report = fopen(path, "w");
+
+    if (report == NULL) {
+        perror("fopen");
+        return NULL;
+    }
+
+    fprintf(report, REPORT_HEADER "%u/%u\n", shard->index, shard->count);
+    return report;
+}
+
+
+void report_add(FILE * report, const char resume_filename[], trc_verdict verdict)
+{
+    /* Add the verdict of a resume file to the report.
+     */
+
+    const char * suffix = find_resume_suffix(resume_filename);
+
+    if (suffix)
+        fprintf(report, "%.*s", RESUME_SUFFIX_LEN, suffix);
+    else
+        fprintf(report, "-");
+
+    fprintf(report, "\t%s\t%s\n", trc_verdict_to_str(verdict), resume_filename);
+}
+
+
+static void write_footer(FILE * report, const int nb_verdicts[])
+{
+    /* Summary of the verdicts (informative only, ignored by merges).
+     */
+
+    int total = 0;
+    int i;
+
+    for (i = 0; i < TRC_VERDICT_COUNT; i++)
+        total += nb_verdicts[i];
+
+    fprintf(report, "# total: %d", total);
+    for (i = 0; i < TRC_VERDICT_COUNT; i++)
+        fprintf(report, " %s: %d", trc_verdict_to_str(i), nb_verdicts[i]);
+    fprintf(report, "\n");
+}
+
+
+int report_close(FILE * report, const int nb_verdicts[])
+{
+    /* Write the footer and close the report.
+     */
+
+    write_footer(report, nb_verdicts);
+
+    if (fclose(report) != 0) {
+        perror("fclose");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+static int compare_entries(const void * a, const void * b)
+{
+    const report_entry * ea = a;
+    const report_entry * eb = b;
+    int cmp = strcmp(ea->suffix, eb->suffix);
+
+    return (cmp != 0) ? cmp : strcmp(ea->filename, eb->filename);
+}
+
+
+static bool parse_header(const char line[], unsigned int * index, unsigned int * count, bool * merged)
+{
+    /* Parse "# transmission-check report <i>/<N>" (index is "*" if merged).
+     */
+
+    shard_spec shard;
+    char spec[32];
+    size_t len;
+
+    if (strncmp(line, REPORT_HEADER, sizeof(REPORT_HEADER) - 1) != 0)
+        return false;
+
+    line += sizeof(REPORT_HEADER) - 1;
+    len = strcspn(line, "\n");
+    if (len == 0 || len >= sizeof(spec))
+        return false;
+
+    memcpy(spec, line, len);
+    spec[len] = '\0';
+
+    *merged = (spec[0] == '*');
+    if (*merged)
+        spec[0] = '0';
+
+    if (!parse_shard_spec(spec, &shard))
+        return false;
+
+    *index = shard.index;
+    *count = shard.count;
+    return true;
+}
+
+
+static bool parse_entry(char * line, report_entry * entry)
+{
+    /* Split "<suffix>\t<verdict>\t<filename>\n" in place.
+     */
+
+    char * verdict;
+    char * filename;
+    size_t len;
+
+    verdict = strchr(line, '\t');
+    if (verdict == NULL)
+        return false;
+    *verdict++ = '\0';
+
+    filename = strchr(verdict, '\t');
+    if (filename == NULL)
+        return false;
+    *filename++ = '\0';
+
+    len = strlen(filename);
+    if (len > 0 && filename[len - 1] == '\n')
+        filename[--len] = '\0';
+    if (len == 0)
+        return false;
+
+    if (!verdict_from_str(verdict, &entry->verdict))
+        return false;
+
+    entry->line = line;
+    entry->suffix = line;
+    entry->filename = filename;
+    return true;
+}
+
+
+int merge_reports(const char * reports[], int nb_reports, const char output[])
+{
+    /* Merge partial reports written by the shards of a resume directory.
+     * Entries are sorted by suffix, duplicates and missing shards are
+     * reported on stderr.
+     * The merged report is written to 'output' or to stdout if NULL.
+     */
+
+    report_entry * entries = NULL;
+    size_t nb_entries = 0, alloc_entries = 0;
+    unsigned int shard_count = 0;
+    bool * seen_shards = NULL;
+    int nb_verdicts[TRC_VERDICT_COUNT] = { 0 };
+    int ret = EXIT_SUCCESS;
+    FILE * out = stdout;
+    size_t i;
+    int r;
+
+    for (r = 0; r < nb_reports; r++) {
+        FILE * in = fopen(reports[r], "r");
+        char * line = NULL;
+        size_t line_size = 0;
+        unsigned int index, count;
+        bool merged;
+        int line_nb = 1;
+
+        if (in == NULL) {
+            fprintf(stderr, "ERROR: Report '%s' could not be opened !\n", reports[r]);
+            ret = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        if (getline(&line, &line_size, in) == -1
+                || !parse_header(line, &index, &count, &merged)) {
+            fprintf(stderr, "ERROR: '%s' is not a report !\n", reports[r]);
+            free(line);
+            fclose(in);
+            ret = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        if (shard_count == 0) {
+            shard_count = count;
+            seen_shards = calloc(shard_count, sizeof(*seen_shards));
+            if (seen_shards == NULL) {
+                PRINT_MEMORY_ERROR()
+                exit(EXIT_FAILURE);
+            }
+        } else if (count != shard_count) {
+            fprintf(stderr, "ERROR: '%s' was made with %u shards, expected %u !\n",
+                    reports[r], count, shard_count);
+            free(line);
+            fclose(in);
+            ret = EXIT_FAILURE;
+            goto cleanup;
+        }
+
+        if (merged) {
+            for (i = 0; i < shard_count; i++)
+                seen_shards[i] = true;
+        } else if (seen_shards[index]) {
+            fprintf(stderr, "WARNING: Shard %u/%u given twice\n", index, shard_count);
+        } else {
+            seen_shards[index] = true;
+        }
+
+        free(line);
+        line = NULL;
+        line_size = 0;
+
+        while (getline(&line, &line_size, in) != -1) {
+            line_nb++;
+
+            if (line[0] == '#' || line[0] == '\n') {
+                continue;
+            }
+
+            if (nb_entries == alloc_entries) {
+                report_entry * tmp_ptr;
+
+                alloc_entries = alloc_entries ? alloc_entries * 2 : 1024;
+                tmp_ptr = realloc(entries, alloc_entries * sizeof(*entries));
+                if (tmp_ptr == NULL) {
+                    PRINT_MEMORY_ERROR()
+                    exit(EXIT_FAILURE);
+                }
+                entries = tmp_ptr;
+            }
+
+            if (parse_entry(line, &entries[nb_entries])) {
+                nb_entries++;
+            } else {
+                fprintf(stderr, "WARNING: %s:%d: Malformed line ignored\n", reports[r], line_nb);
+                free(line);
+            }
+
+            // The entry keeps the line
+            line = NULL;
+            line_size = 0;
+        }
+
+        free(line);
+        fclose(in);
+    }
+
+    for (i = 0; i < shard_count; i++) {
+        if (!seen_shards[i]) {
+            fprintf(stderr, "ERROR: Shard %zu/%u is missing !\n", i, shard_count);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    qsort(entries, nb_entries, sizeof(*entries), compare_entries);
+
+    if (output) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            perror("fopen");
+            ret = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+
+    fprintf(out, REPORT_HEADER "*/%u\n", shard_count);
+
+    for (i = 0; i < nb_entries; i++) {
+        if (i > 0 && strcmp(entries[i].filename, entries[i - 1].filename) == 0) {
+            fprintf(stderr, "WARNING: '%s' is reported by several shards\n", entries[i].filename);
+            continue;
+        }
+
+        fprintf(out, "%s\t%s\t%s\n", entries[i].suffix,
+                trc_verdict_to_str(entries[i].verdict), entries[i].filename);
+        nb_verdicts[entries[i].verdict]++;
+    }
+
+    if (output) {
+        if (report_close(out, nb_verdicts) != EXIT_SUCCESS)
+            ret = EXIT_FAILURE;
+    } else {
+        write_footer(out, nb_verdicts);
+    }
+
+cleanup:
+    for (i = 0; i < nb_entries; i++)
+        free(entries[i].line);
+    free(entries);
+    free(seen_shards);
+    return ret;
+}
@@ -0,0 +1,114 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <stdio.h> // perror(), sprintf()
+#include <stdlib.h> // malloc(), realloc(), qsort()
+#include <string.h> // strchr(), strcmp(), strdup(), strlen()
+#include <dirent.h> // opendir(), readdir()
+
+#include "common.h"
+#include "resume_dir.h"
+
+
+static int compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+int list_resume_files(const char dir_path[], char *** names)
+{
+    /* List the names of the resume files of a directory (sorted).
+     * Return the number of files, or -1 on error.
+     * The names and the array must be freed by the caller.
+     */
+
+    DIR * dir;
+    struct dirent * entry;
+    char ** tmp_ptr;
+    int nb_names = 0;
+    int alloc_names = 0;
+
+    *names = NULL;
+    dir = opendir(dir_path);
+
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+
+        if (len <= strlen(".resume")
+                || strcmp(&entry->d_name[len - strlen(".resume")], ".resume") != 0)
+            continue;
+
+        if (nb_names == alloc_names) {
+            alloc_names = alloc_names ? alloc_names * 2 : 256;
+            tmp_ptr = realloc(*names, alloc_names * sizeof(**names));
+
+            if (tmp_ptr == NULL) {
+                PRINT_MEMORY_ERROR()
+                exit(EXIT_FAILURE);
+            }
+            *names = tmp_ptr;
+        }
+
+        (*names)[nb_names] = strdup(entry->d_name);
+        if ((*names)[nb_names] == NULL) {
+            PRINT_MEMORY_ERROR()
+            exit(EXIT_FAILURE);
+        }
+        nb_names++;
+    }
+
+    closedir(dir);
+
+    // Same order on every host
+    qsort(*names, nb_names, sizeof(**names), compare_names);
+    return nb_names;
+}
+
+
+char * join_path(const char dir_path[], const char name[])
+{
+    /* Return "dir_path/name" (must be freed by the caller).
+     */
+
+    char * path = malloc(strlen(dir_path) + strlen(name) + 2);
+
+    if (path == NULL) {
+        PRINT_MEMORY_ERROR()
+        exit(EXIT_FAILURE);
+    }
+
+    sprintf(path, "%s/%s", dir_path, name);
+    return path;
+}
+
+
+bool is_safe_name(const char name[])
+{
+    /* Names read from a patch or an archive may only designate
+     * a file of the given directory.
+     */
+
+    return *name && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
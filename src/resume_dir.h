@@ -0,0 +1,29 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_RESUME_DIR_H
+#define TR_CHECK_RESUME_DIR_H
+
+#include <stdbool.h>
+
+int list_resume_files(const char dir_path[], char *** names);
+char * join_path(const char dir_path[], const char name[]);
+bool is_safe_name(const char name[]);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <string.h> // strlen(), strcmp()
+#include <stdlib.h> // strtoul()
+#include <ctype.h> // islower(), isdigit()
+#include <errno.h>
+
+#include "shard.h"
+
+
+const char * find_resume_suffix(const char resume_filename[])
+{
+    /* Locate the info-hash suffix of a resume filename.
+     * Equivalent to the regex "\.([[:lower:][:digit:]]{16})\.resume$"
+     * Return a pointer to the first character of the suffix (not
+     * null-terminated), or NULL if the filename does not match.
+     */
+
+    static const char extension[] = ".resume";
+    size_t ext_len = sizeof(extension) - 1;
+    size_t len = strlen(resume_filename);
+    const char * suffix;
+    size_t i;
+
+    if (len < ext_len + RESUME_SUFFIX_LEN + 1)
+        return NULL;
+
+    if (strcmp(&resume_filename[len - ext_len], extension) != 0)
+        return NULL;
+
+    suffix = &resume_filename[len - ext_len - RESUME_SUFFIX_LEN];
+
+    if (*(suffix - 1) != '.')
+        return NULL;
+
+    for (i = 0; i < RESUME_SUFFIX_LEN; i++) {
+        if (!islower((unsigned char)suffix[i]) && !isdigit((unsigned char)suffix[i]))
+            return NULL;
+    }
+
+    return suffix;
+}
+
+
+const char * resume_join_key(const char resume_filename[], size_t * len)
+{
+    /* Resume files of different directories (or archives) are joined on
+     * their info-hash suffix (on the whole name if there is no suffix).
+     */
+
+    const char * suffix = find_resume_suffix(resume_filename);
+
+    if (suffix) {
+        *len = RESUME_SUFFIX_LEN;
+        return suffix;
+    }
+
+    *len = strlen(resume_filename);
+    return resume_filename;
+}
+
+
+bool parse_shard_spec(const char spec[], shard_spec * shard)
+{
+    /* Parse a "i/N" shard specification (0 <= i < N).
+     * Return false if the specification is malformed.
+     */
+
+    char * end = NULL;
+    unsigned long index, count;
+
+    errno = 0;
+    index = strtoul(spec, &end, 10);
+    if (errno || end == spec || *end != '/')
+        return false;
+
+    spec = end + 1;
+    count = strtoul(spec, &end, 10);
+    if (errno || end == spec || *end != '\0')
+        return false;
+
+    if (count == 0 || index >= count || count > 1u << 16)
+        return false;
+
+    shard->index = index;
+    shard->count = count;
+    return true;
+}
+
+
+uint64_t suffix_hash(const char suffix[])
+{
+    /* 64 bits FNV-1a hash of the info-hash suffix.
+     * The result does not depend on the host, so every process/host
+     * given the same shard count computes the same partition.
+     */
+
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < RESUME_SUFFIX_LEN; i++) {
+        hash ^= (unsigned char)suffix[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+bool is_in_shard(const char resume_filename[], const shard_spec * shard)
+{
+    /* Tell if the given resume file belongs to the given shard.
+     * Files without a valid suffix can not be hashed: they are handled
+     * by the shard 0 so that they are still reported once.
+     */
+
+    const char * suffix;
+
+    if (shard->count <= 1)
+        return true;
+
+    suffix = find_resume_suffix(resume_filename);
+
+    if (suffix == NULL)
+        return shard->index == 0;
+
+    return suffix_hash(suffix) % shard->count == shard->index;
+}
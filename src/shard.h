@@ -0,0 +1,41 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_SHARD_H
+#define TR_CHECK_SHARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Length of the info-hash suffix in "name.<suffix>.resume"
+#define RESUME_SUFFIX_LEN 16
+
+typedef struct shard_spec {
+    unsigned int index; // 0-based
+    unsigned int count;
+} shard_spec;
+
+const char * find_resume_suffix(const char resume_filename[]);
+const char * resume_join_key(const char resume_filename[], size_t * len);
+bool parse_shard_spec(const char spec[], shard_spec * shard);
+uint64_t suffix_hash(const char suffix[]);
+bool is_in_shard(const char resume_filename[], const shard_spec * shard);
+
+#endif
@@ -0,0 +1,951 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#define _FILE_OFFSET_BITS 64 // Fix warning "stat: Value too large for defined data type"
+#include <stdarg.h> // va_list
+#include <string.h> // strlen(), strstr(), strcmp()
+#include <stdlib.h> // malloc(), free()
+#include <time.h> // ctime_r(), localtime_r()
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h> // stat()
+#include <ftw.h> // ftw()
+
+#include "io.h"
+#include "metrics.h"
+#include "shard.h"
+#include "trcheck.h"
+
+// Cost of one entry of a walk (one inode block read) for the I/O scheduler
+#define IO_WALK_COST 4096
+
+static const char * error_messages[TRC_ERR_COUNT] = {
+    [TRC_OK] = "Success",
+    [TRC_ERR_NOMEM] = "Insufficient memory",
+    [TRC_ERR_LOAD] = "Resume file could not be opened",
+    [TRC_ERR_SAVE] = "Resume file could not be saved",
+    [TRC_ERR_NO_DESTINATION] = "TR_KEY_destination could not be read",
+    [TRC_ERR_NO_NAME] = "TR_KEY_name could not be read",
+    [TRC_ERR_NOT_FOUND] = "Uploaded file/directory not found",
+    [TRC_ERR_BAD_FILENAME] = "Resume file has an incorrect name",
+    [TRC_ERR_IO] = "Input/output error",
+};
+
+static const char * verdict_names[TRC_VERDICT_COUNT] = {
+    [TRC_VERDICT_OK] = "ok",
+    [TRC_VERDICT_ERROR] = "error",
+    [TRC_VERDICT_INCONSISTENT] = "inconsistent",
+    [TRC_VERDICT_REPAIRED] = "repaired",
+};
+
+// Walk in progress (ftw() callbacks have no user data)
+static __thread trc_ctx * walk_ctx = NULL;
+static __thread uint64_t walk_last_entry = 0;
+
+
+static void * default_malloc(size_t size, void * user __attribute__((unused)))
+{
+    return malloc(size);
+}
+
+
+static void default_free(void * ptr, void * user __attribute__((unused)))
+{
+    free(ptr);
+}
+
+
+static void log_out(const trc_ctx * ctx, const char * format, ...)
+{
+    va_list args;
+
+    if (ctx->out == NULL)
+        return;
+
+    va_start(args, format);
+    vfprintf(ctx->out, format, args);
+    va_end(args);
+}
+
+
+static void log_err(const trc_ctx * ctx, const char * format, ...)
+{
+    va_list args;
+
+    if (ctx->err == NULL)
+        return;
+
+    va_start(args, format);
+    vfprintf(ctx->err, format, args);
+    va_end(args);
+}
+
+
+static trc_error fail(trc_ctx * ctx, trc_error error)
+{
+    /* Record the error of the call and return it.
+     */
+
+    if (error == TRC_ERR_NOMEM)
+        log_err(ctx, "ERROR: Insufficient memory\n\n");
+
+    ctx->error = error;
+    return error;
+}
+
+
+static void * ctx_malloc(trc_ctx * ctx, size_t size)
+{
+    return ctx->allocator.malloc(size, ctx->allocator.user);
+}
+
+
+static void ctx_free(trc_ctx * ctx, void * ptr)
+{
+    if (ptr)
+        ctx->allocator.free(ptr, ctx->allocator.user);
+}
+
+
+static const char * format_date(int64_t timestamp, char buffer[26])
+{
+    /* Reentrant ctime() (with its trailing '\n').
+     */
+
+    time_t date = (time_t)timestamp;
+
+    if (ctime_r(&date, buffer) == NULL)
+        strcpy(buffer, "?\n");
+    return buffer;
+}
+
+
+void trc_init(trc_ctx * ctx, const trc_allocator * allocator)
+{
+    /* Default parameters: no changes, stdout/stderr, libc allocator.
+     */
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->out = stdout;
+    ctx->err = stderr;
+
+    if (allocator) {
+        ctx->allocator = *allocator;
+    } else {
+        ctx->allocator.malloc = default_malloc;
+        ctx->allocator.free = default_free;
+    }
+}
+
+
+const char * trc_strerror(trc_error error)
+{
+    if (error < 0 || error >= TRC_ERR_COUNT)
+        return "Unknown error";
+    return error_messages[error];
+}
+
+
+const char * trc_verdict_to_str(trc_verdict verdict)
+{
+    if (verdict < 0 || verdict >= TRC_VERDICT_COUNT)
+        return "unknown";
+    return verdict_names[verdict];
+}
+
+
+static int is_file_or_dir_exists(trc_ctx * ctx, const char *path)
+{
+    /* Detect if the given file/directory exists.
+     * Return 0 if does not exist or if the type is unknown/not supported.
+     * Return 1,2 or 3 if exists and is a directory, symlink or regular file.
+     * Return -1 on error.
+     */
+
+    struct stat info;
+    int err = 0;
+
+    // On success, zero is returned. On error, -1 is returned, and errno is set appropriately.
+    err = stat(path, &info);
+
+    if(err == -1) {
+        if(errno == ENOENT) {
+            /* does not exist */
+            return 0;
+        } else {
+            log_err(ctx, "stat: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    // directory : info.st_mode & S_IFDIR
+    switch (info.st_mode & S_IFMT) {
+    case S_IFDIR:  log_out(ctx, "Directory found... ");        return 1;
+    case S_IFLNK:  log_out(ctx, "Symlink found... ");          return 2;
+    case S_IFREG:  log_out(ctx, "Regular file found... ");     return 3;
+    default:       log_out(ctx, "Unknown type?\n");            return 0;
+    }
+
+    return 0;
+}
+
+
+static int sum_sizes(const char *fpath __attribute__((unused)), const struct stat *sb, int typeflag __attribute__((unused)))
+{
+    /* Callback for ftw() function.
+     * Calculate the size of the given file and increment the total size of the walk.
+     * With a scheduler, each entry costs IO_WALK_COST bytes; the latency is the
+     * time spent by ftw() since the previous entry (readdir(), stat()).
+     */
+
+    io_sched * sched = walk_ctx->io;
+
+    if (sched) {
+        io_sched_feedback(sched, metrics_now() - walk_last_entry);
+        io_sched_wait(sched, IO_WALK_COST);
+        walk_last_entry = metrics_now();
+    }
+
+    walk_ctx->total_size += sb->st_size;
+    return 0;
+}
+
+
+static trc_error check_uploaded_files(trc_ctx * ctx, const char full_path[])
+{
+    /* Test the existence of the given file/directory.
+     * Calculate the size.
+     */
+
+    int err = 0;
+    int exists;
+    uint64_t start;
+
+    exists = is_file_or_dir_exists(ctx, full_path);
+
+    if (exists == -1)
+        return fail(ctx, TRC_ERR_IO);
+
+    if (exists == 0) {
+        log_err(ctx, "ERROR: Uploaded file/directory '%s' not found !\n", full_path);
+        return fail(ctx, TRC_ERR_NOT_FOUND);
+    }
+
+    ctx->total_size = 0;
+    walk_ctx = ctx;
+    walk_last_entry = metrics_now();
+
+    start = metrics_start();
+    err = ftw(full_path, &sum_sizes, 1);
+    metrics_stop(STAGE_WALK, start);
+
+    walk_ctx = NULL;
+
+    if (err == -1) {
+        log_err(ctx, "ftw: %s\n", strerror(errno));
+        return fail(ctx, TRC_ERR_IO);
+    }
+
+    log_out(ctx, "Total bytes: %" PRIu64 "\n", ctx->total_size);
+    return TRC_OK;
+}
+
+
+static trc_error get_uploaded_files_path(trc_ctx * ctx, tr_variant * top, char ** full_path)
+{
+    /* Compute the full path of file/directory downloaded by the torrent.
+     * The path must be freed with the allocator of the context.
+     */
+
+    size_t dest_len, name_len;
+    const char * dest;
+    const char * name;
+
+    *full_path = NULL;
+
+    if (!tr_variantDictFindStr (top, TR_KEY_destination, &dest, &dest_len) || !(dest && *dest))
+    {
+        log_err(ctx, "ERROR: Resume file: TR_KEY_destination could not be read !\n");
+        return fail(ctx, TRC_ERR_NO_DESTINATION);
+    }
+
+    if (!tr_variantDictFindStr (top, TR_KEY_name, &name, &name_len))
+    {
+        log_err(ctx, "ERROR: Resume file: TR_KEY_name could not be read !\n");
+        return fail(ctx, TRC_ERR_NO_NAME);
+    }
+
+    // length of destination + length of name + length if '/' + '\0'
+    *full_path = ctx_malloc(ctx, dest_len + name_len + 2);
+
+    if (*full_path == NULL)
+        return fail(ctx, TRC_ERR_NOMEM);
+
+    memcpy(*full_path, dest, dest_len);
+    (*full_path)[dest_len] = '/';
+    memcpy(*full_path + dest_len + 1, name, name_len);
+    (*full_path)[dest_len + name_len + 1] = '\0';
+
+    return TRC_OK;
+}
+
+
+static void update_dates(trc_ctx * ctx, tr_variant * top, const char date_name[], const tr_quark date_type,
+                         int64_t old_timestamp, time_t new_timestamp,
+                         bool force_date_update)
+{
+    /* Update the dates according to the given parameters:
+     * old_timestamp is replaced by new_timestamp
+     * if make_changes is true:
+     * and date is erroneous
+     * or force_date_update is true
+     *
+     * The date type (key in tr_variant dict is given by 'date_type';
+     * the name of the manipulated date is given by the string 'date_name'.
+     *
+     * In case of replacement, new date is the last file modification date.
+     */
+
+    struct tm instant;
+    time_t old_date = (time_t)old_timestamp;
+    char date[26];
+
+    localtime_r(&old_date, &instant);
+
+    // Change date if it is Erroneous or if force_date_update is set to true
+    if (instant.tm_year + 1900 == 1970 || force_date_update) {
+
+        ctx->nb_inconsistencies++;
+
+        if (ctx->make_changes) {
+            tr_variantDictAddInt(top, date_type, new_timestamp);
+            log_out(ctx, "REPAIR: Erroneous %s date: Updated to modification date: %s", date_name, format_date(new_timestamp, date));
+
+            ctx->nb_repaired_inconsistencies++;
+        } else {
+            // Just inform that an erroneous date was encountered...
+            log_out(ctx, "Erroneous %s date detected !\n", date_name);
+        }
+    }
+}
+
+
+static trc_error check_dates(trc_ctx * ctx, tr_variant * top, const char full_path[], bool force_date_update)
+{
+    /* Try to resolve date problems (incorrect/corrupted dates)
+     * On error => update the field with last file modification date.
+     */
+
+    struct stat sb;
+    int err = 0;
+    int64_t  old_timestamp;
+    uint64_t start;
+
+    start = metrics_start();
+    err = stat(full_path, &sb);
+    metrics_stop(STAGE_STAT, start);
+
+    if(err == -1) {
+        log_err(ctx, "stat: %s\n", strerror(errno));
+        return fail(ctx, TRC_ERR_IO);
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_added_date, &old_timestamp))
+    {
+        update_dates(ctx, top, "added", TR_KEY_added_date,
+                     old_timestamp, sb.st_mtime, force_date_update);
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_done_date, &old_timestamp))
+    {
+        update_dates(ctx, top, "done", TR_KEY_done_date,
+                     old_timestamp, sb.st_mtime, force_date_update);
+    }
+
+    return TRC_OK;
+}
+
+
+static void reset_peers(trc_ctx * ctx, tr_variant * top)
+{
+    /* Reset peers in the resume file.
+     */
+
+    size_t len;
+    const uint8_t * str_8;
+
+    if (tr_variantDictFindRaw (top, TR_KEY_peers2, &str_8, &len))
+    {
+        // reinit peers
+        tr_variantDictAddRaw (top, TR_KEY_peers2, NULL, 0);
+    }
+
+    if (tr_variantDictFindRaw (top, TR_KEY_peers2_6, &str_8, &len))
+    {
+        // reinit peers
+        tr_variantDictAddRaw (top, TR_KEY_peers2_6, NULL, 0);
+    }
+
+    log_out(ctx, "REPAIR: Peers cleared.\n");
+}
+
+
+static trc_error check_correct_files_pointed(trc_ctx * ctx, tr_variant * top, const char resume_filename[],
+                                             bool * name_repaired)
+{
+    /* Verify if file/directory of the torrent matches the resume filename.
+     * If not, we try to infer the original name from the name of the resume filename.
+     * In this case, name_repaired is set and nb_repaired_inconsistencies is incremented.
+     * Note: If name_repaired is set here,
+     * full_path variable must be updated with the new inferred file
+     * (and we have to verify of the inferred file exists).
+     * Note: Since corrupted resume files get their dates from the bad pointed file,
+     * dates must also be updated, even if they are correct (above 1970 ...).
+     */
+
+    const char * actual_file;
+    const char * suffix;
+    char * inferred_file = NULL;
+    size_t start;
+
+    *name_repaired = false;
+
+    // Get file downloaded
+    if (!tr_variantDictFindStr(top, TR_KEY_name, &actual_file, NULL))
+        return fail(ctx, TRC_ERR_NO_NAME);
+
+    // No pb in file names
+    if(strstr(resume_filename, actual_file) != NULL) {
+        return TRC_OK;
+    }
+
+
+    log_out(ctx, "REPAIR: Resume file does not point to the correct file/directory !\n");
+    log_out(ctx, "REPAIR: Trying to resolve inconsistencies...\n");
+
+    // "name.<16 lower/digit chars>.resume"
+    suffix = find_resume_suffix(resume_filename);
+
+    if (suffix == NULL) {
+        log_err(ctx, "ERROR: Resume file has an incorrect name !\n");
+        return fail(ctx, TRC_ERR_BAD_FILENAME);
+    }
+
+    // get [0;x] included, where x is the position of the '.' before the suffix
+    start = suffix - 1 - resume_filename;
+    inferred_file = ctx_malloc(ctx, start + 1);
+
+    if (inferred_file == NULL)
+        return fail(ctx, TRC_ERR_NOMEM);
+
+    memcpy(inferred_file, resume_filename, start);
+    inferred_file[start] = '\0';
+
+    log_out(ctx, "REPAIR: Inferred file: %s\n", inferred_file);
+
+    // Update the resume file
+    tr_variantDictAddStr(top, TR_KEY_name, inferred_file);
+    ctx->nb_inconsistencies++;
+    ctx->nb_repaired_inconsistencies++;
+    *name_repaired = true;
+
+    // Deallocate memory
+    ctx_free(ctx, inferred_file);
+    return TRC_OK;
+}
+
+
+trc_error trc_replace_dir(trc_ctx * ctx, tr_variant * top, const char old[], const char new[])
+{
+    /* Replace old substring in path by the new string.
+     * A destination without the substring is not an error.
+     * The results of the context are reset: they only describe this call.
+     */
+
+    size_t len;
+    const char * str;
+    const char * start = NULL;
+    char * new_path = NULL;
+
+    ctx->error = TRC_OK;
+    ctx->nb_inconsistencies = 0;
+    ctx->nb_repaired_inconsistencies = 0;
+    ctx->total_size = 0;
+
+    if ((tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
+            && (str && *str))
+    {
+
+        start = strstr(str, old);
+
+        if(start) {
+
+            size_t prefix_length = start - str;
+            const char * suffix_start_addr = start + strlen(old);
+
+            new_path = ctx_malloc(ctx, strlen(str) - strlen(old) + strlen(new) + 1);
+
+            if (new_path == NULL)
+                return fail(ctx, TRC_ERR_NOMEM);
+
+            // Add prefix
+            memcpy(new_path, str, prefix_length);
+            new_path[prefix_length] = '\0';
+            // Add new string
+            strcat(new_path, new);
+            // Add suffix
+            strcat(new_path, suffix_start_addr);
+
+            // Update the resume file
+            tr_variantDictAddStr(top, TR_KEY_destination, new_path);
+            log_out(ctx, "UPDATE: New path: %s\n", new_path);
+
+            ctx->nb_inconsistencies++;
+            ctx->nb_repaired_inconsistencies++;
+            ctx_free(ctx, new_path);
+        } else {
+            log_err(ctx, "ERROR: Substring '%s' not found in '%s'\n", old, str);
+        }
+    }
+
+    return TRC_OK;
+}
+
+
+void trc_print_resume(trc_ctx * ctx, tr_variant * top)
+{
+    /* Display informations taken from the resume file.
+     * Note: This is not exhaustive.
+     */
+
+    size_t len;
+    int64_t  i;
+    const char * str;
+    tr_variant * dict;
+    bool boolVal;
+    char date[26];
+
+
+    log_out(ctx, "\n==============================\n");
+    log_out(ctx, "   Resume file informations   \n");
+    log_out(ctx, "==============================\n\n");
+
+    // Directories/files
+    if ((tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
+            && (str && *str))
+    {
+        log_out(ctx, "TR_KEY_destination %s\n", str);
+    }
+
+    if ((tr_variantDictFindStr (top, TR_KEY_incomplete_dir, &str, &len))
+            && (str && *str))
+    {
+        log_out(ctx, "TR_KEY_incomplete_dir %s\n", str);
+    }
+
+    if (tr_variantDictFindStr (top, TR_KEY_name, &str, NULL))
+    {
+        log_out(ctx, "TR_KEY_name %s\n", str);
+    }
+
+    // DL/UP stats & state
+    if (tr_variantDictFindInt (top, TR_KEY_downloaded, &i))
+    {
+        log_out(ctx, "TR_KEY_downloaded %" PRIu64 "\n", i);
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_uploaded, &i))
+    {
+        log_out(ctx, "TR_KEY_uploaded %" PRIu64 "\n", i);
+    }
+
+    if (tr_variantDictFindBool (top, TR_KEY_paused, &boolVal))
+    {
+        log_out(ctx, "TR_KEY_paused %d\n", boolVal);
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_seeding_time_seconds, &i))
+    {
+        log_out(ctx, "TR_KEY_seeding_time_seconds %" PRIu64 "\n", i);
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_downloading_time_seconds, &i))
+    {
+        log_out(ctx, "TR_KEY_downloading_time_seconds %" PRIu64 "\n", i);
+    }
+
+    // Timestamped informations
+    if (tr_variantDictFindInt (top, TR_KEY_added_date, &i))
+    {
+        log_out(ctx, "TR_KEY_added_date %" PRIu64 ": %s", i, format_date(i, date));
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_done_date, &i))
+    {
+        log_out(ctx, "TR_KEY_done_date %" PRIu64 ": %s", i, format_date(i, date));
+    }
+
+    if (tr_variantDictFindInt (top, TR_KEY_activity_date, &i))
+    {
+        log_out(ctx, "TR_KEY_activity_date %" PRIu64 ": %s", i, format_date(i, date));
+    }
+
+
+
+    if (tr_variantDictFindInt (top, TR_KEY_bandwidth_priority, &i)
+            /*&& tr_isPriority (i)*/)
+    {
+        log_out(ctx, "TR_KEY_bandwidth_priority %" PRIu64 "\n", i);
+    }
+
+    // Limits (speed & peers)
+    if (tr_variantDictFindInt (top, TR_KEY_max_peers, &i))
+    {
+        log_out(ctx, "TR_KEY_max_peers %" PRIu64 "\n", i);
+    }
+
+    if (tr_variantDictFindDict (top, TR_KEY_speed_limit_up, &dict))
+    {
+        log_out(ctx, "Speed limit up:\n");
+
+        if (tr_variantDictFindInt (dict, TR_KEY_speed_Bps, &i))
+        {
+            log_out(ctx, "\tTR_KEY_speed_Bps %" PRIu64 "\n", i);
+        }
+        else if (tr_variantDictFindInt (dict, TR_KEY_speed, &i))
+            log_out(ctx, "\tTR_KEY_speed %" PRIu64 "\n", i*1024);
+
+        if (tr_variantDictFindBool (dict, TR_KEY_use_speed_limit, &boolVal))
+            log_out(ctx, "\tTR_KEY_use_speed_limit %d\n", boolVal);
+
+        if (tr_variantDictFindBool (dict, TR_KEY_use_global_speed_limit, &boolVal))
+            log_out(ctx, "\tTR_KEY_use_global_speed_limit %d\n", boolVal);
+    }
+
+    if (tr_variantDictFindDict (top, TR_KEY_speed_limit_down, &dict))
+    {
+        log_out(ctx, "Speed limit down:\n");
+
+        if (tr_variantDictFindInt (dict, TR_KEY_speed_Bps, &i))
+        {
+            log_out(ctx, "\tTR_KEY_speed_Bps %" PRIu64 "\n", i);
+        }
+        else if (tr_variantDictFindInt (dict, TR_KEY_speed, &i))
+            log_out(ctx, "\tTR_KEY_speed %" PRIu64 "\n", i*1024);
+
+        if (tr_variantDictFindBool (dict, TR_KEY_use_speed_limit, &boolVal))
+            log_out(ctx, "\tTR_KEY_use_speed_limit %d\n", boolVal);
+
+        if (tr_variantDictFindBool (dict, TR_KEY_use_global_speed_limit, &boolVal))
+            log_out(ctx, "\tTR_KEY_use_global_speed_limit %d\n", boolVal);
+    }
+
+    // Peers list
+    const uint8_t * str_8;
+
+    if (tr_variantDictFindRaw (top, TR_KEY_peers2, &str_8, &len))
+    {
+        log_out(ctx, "TR_KEY_peers2 %zu bytes\n", len);
+    }
+
+    if (tr_variantDictFindRaw (top, TR_KEY_peers2_6, &str_8, &len))
+    {
+        log_out(ctx, "TR_KEY_peers2_6 %zu bytes\n", len);
+    }
+
+
+    /* Fields not supported (yet)
+     i **f (fieldsToLoad & TR_FR_PEERS)
+     fieldsLoaded |= loadPeers (top, tor);
+
+     i *f (fieldsToLoad & TR_FR_FILE_PRIORITIES)
+     fieldsLoaded |= loadFilePriorities (top, tor);
+
+     if (fieldsToLoad & TR_FR_PROGRESS)
+         fieldsLoaded |= loadProgress (top, tor);
+
+     if (fieldsToLoad & TR_FR_DND)
+         fieldsLoaded |= loadDND (top, tor);
+
+     if (fieldsToLoad & TR_FR_RATIOLIMIT)
+         fieldsLoaded |= loadRatioLimits (top, tor);
+
+     if (fieldsToLoad & TR_FR_IDLELIMIT)
+         fieldsLoaded |= loadIdleLimits (top, tor);
+
+     if (fieldsToLoad & TR_FR_FILENAMES)
+         fieldsLoaded |= loadFilenames (top, tor);
+
+     if (fieldsToLoad & TR_FR_NAME)
+         fieldsLoaded |= loadName (top, tor);
+     */
+
+    /*
+    tr_variant * list;
+
+    if (tr_variantDictFindList (top, TR_KEY_files, &list))
+    {
+        size_t i;
+        const size_t n = tr_variantListSize (list);
+        log_out(ctx, "TR_KEY_files found\n");
+
+        for (i=0; i<n; ++i)
+        {
+            //const char * str;
+            size_t str_len;
+            if (tr_variantGetStr (tr_variantListChild (list, i), &str, &str_len) && str && str_len)
+            {
+                log_out(ctx, "TR_KEY_files %s\n", str);
+            }
+        }
+    }
+    */
+}
+
+
+trc_error trc_repair(trc_ctx * ctx, tr_variant * top, const char resume_filename[])
+{
+    /* Repair entry point
+     * resume_filename is the basename of the resume file.
+     * The results of the context are reset: they only describe this call.
+     */
+
+    bool name_repaired = false;
+    char * full_path = NULL;
+    trc_error err;
+    uint64_t start = metrics_start();
+
+    ctx->error = TRC_OK;
+    ctx->nb_inconsistencies = 0;
+    ctx->nb_repaired_inconsistencies = 0;
+    ctx->total_size = 0;
+
+    log_out(ctx, "\n==============================\n");
+    log_out(ctx, "        Repair attempts       \n");
+    log_out(ctx, "==============================\n\n");
+
+    // Get the path of downloaded files
+    if ((err = get_uploaded_files_path(ctx, top, &full_path)) != TRC_OK)
+        goto cleanup;
+    log_out(ctx, "Full path: %s\n", full_path);
+
+    // Verify if file/directory of the torrent matches the resume filename
+    if ((err = check_correct_files_pointed(ctx, top, resume_filename, &name_repaired)) != TRC_OK)
+        goto cleanup;
+
+    // Here we know if pointed files were ok or not (name_repaired)
+    // If not, we update the full path and force the update of dates
+    // with the dates of the new directory
+    if (name_repaired) {
+        // Free memory
+        ctx_free(ctx, full_path);
+
+        // Get new full path
+        if ((err = get_uploaded_files_path(ctx, top, &full_path)) != TRC_OK)
+            goto cleanup;
+        log_out(ctx, "REPAIR: New full path: %s\n", full_path);
+    }
+
+    // Check existence of downloaded files
+    if ((err = check_uploaded_files(ctx, full_path)) != TRC_OK)
+        goto cleanup;
+
+    // Check dates
+    if ((err = check_dates(ctx, top, full_path, name_repaired)) != TRC_OK)
+        goto cleanup;
+
+    // If there are inconsistencies (in this call), the file is corrupted => cleaning step
+    // Reset peers list
+    if ((ctx->nb_repaired_inconsistencies > 0) && ctx->make_changes)
+        reset_peers(ctx, top);
+
+    // What was done according to make_changes value
+    if (ctx->make_changes)
+        log_out(ctx, "Repaired inconsistencies: %d\n", ctx->nb_repaired_inconsistencies);
+    else
+        log_out(ctx, "Repaired inconsistencies: 0\n");
+
+cleanup:
+    // Free memory
+    ctx_free(ctx, full_path);
+    metrics_stop(STAGE_REPAIR, start);
+    return err;
+}
+
+
+trc_error trc_load(trc_ctx * ctx, const char path[], tr_variant * top)
+{
+    /* Load a resume file in memory (to be freed with tr_variantFree()).
+     */
+
+    uint64_t start = metrics_start();
+    int err;
+
+    err = tr_variantFromFile (top, TR_VARIANT_FMT_BENC, path);
+    metrics_stop(STAGE_LOAD, start);
+
+    if (err)
+    {
+        log_err(ctx, "ERROR: Resume file could not be opened !\n");
+        return fail(ctx, TRC_ERR_LOAD);
+    }
+
+    return TRC_OK;
+}
+
+
+trc_error trc_save(trc_ctx * ctx, const char path[], tr_variant * top)
+{
+    uint64_t start = metrics_start();
+    int err;
+
+    err = tr_variantToFile(top, TR_VARIANT_FMT_BENC, path);
+    metrics_stop(STAGE_SAVE, start);
+
+    if (err) {
+        log_err(ctx, "ERROR: While saving the new .resume file\n");
+        return fail(ctx, TRC_ERR_SAVE);
+    }
+
+    return TRC_OK;
+}
+
+
+static trc_error check_variant(trc_ctx * ctx, tr_variant * top, const char resume_filename[],
+                               const char replace_old[], const char replace_new[],
+                               const char save_path[], trc_verdict * verdict)
+{
+    /* Common part of trc_check_file() and trc_check_buffer().
+     * The resume file is saved to save_path if there are changes
+     * (make_changes is true); never if save_path is NULL.
+     */
+
+    trc_error err;
+
+    // Show the content of the resume file (verbose mode)
+    if (ctx->verbose)
+        trc_print_resume(ctx, top);
+
+    // Repair or replace directory ?
+    if (replace_old == NULL) {
+        // Repair attempts
+        err = trc_repair(ctx, top, resume_filename);
+    } else {
+        // Replace directory
+        err = trc_replace_dir(ctx, top, replace_old, replace_new);
+    }
+
+    if (err != TRC_OK)
+        return err;
+
+    // Write the resume file if inconsistencies are repaired, and if changes are allowed
+    if (ctx->nb_repaired_inconsistencies > 0 && ctx->make_changes && save_path)
+    {
+        if ((err = trc_save(ctx, save_path, top)) == TRC_OK) {
+            log_out(ctx, "The file was successfully modified.\n");
+            *verdict = TRC_VERDICT_REPAIRED;
+        }
+
+    } else {
+        log_out(ctx, "The file remains untouched.\n");
+
+        // Detected, even if not repaired (make_changes is false)
+        *verdict = (ctx->nb_inconsistencies > 0) ? TRC_VERDICT_INCONSISTENT : TRC_VERDICT_OK;
+    }
+
+    return err;
+}
+
+
+trc_error trc_check_file(trc_ctx * ctx, const char path[],
+                         const char replace_old[], const char replace_new[],
+                         trc_verdict * verdict)
+{
+    /* Check and repair a resume file, or replace a substring of its
+     * destination if replace_old is not NULL.
+     * The file is written only if there are changes and make_changes is true.
+     */
+
+    const char * resume_filename;
+    tr_variant top;
+    trc_error err;
+    uint64_t file_start = metrics_start();
+
+    ctx->error = TRC_OK;
+    ctx->nb_inconsistencies = 0;
+    ctx->nb_repaired_inconsistencies = 0;
+    ctx->total_size = 0;
+    *verdict = TRC_VERDICT_ERROR;
+
+    // Load the resume file in memory
+    if ((err = trc_load(ctx, path, &top)) != TRC_OK)
+        return err;
+
+    // Basename of the resume file
+    resume_filename = strrchr(path, '/');
+    resume_filename = resume_filename ? resume_filename + 1 : path;
+
+    err = check_variant(ctx, &top, resume_filename, replace_old, replace_new, path, verdict);
+
+    // Free memory
+    tr_variantFree (&top);
+    metrics_stop(STAGE_FILE, file_start);
+    return err;
+}
+
+
+trc_error trc_check_buffer(trc_ctx * ctx, const void * data, size_t len,
+                           const char resume_filename[], trc_verdict * verdict)
+{
+    /* Check a resume file already in memory (e.g. stored in an archive).
+     * The buffer is read only: inconsistencies are reported, never repaired
+     * (make_changes is ignored).
+     */
+
+    bool make_changes = ctx->make_changes;
+    tr_variant top;
+    trc_error err;
+    int parse_err;
+    uint64_t file_start = metrics_start();
+    uint64_t start;
+
+    ctx->error = TRC_OK;
+    ctx->nb_inconsistencies = 0;
+    ctx->nb_repaired_inconsistencies = 0;
+    ctx->total_size = 0;
+    *verdict = TRC_VERDICT_ERROR;
+
+    start = metrics_start();
+    parse_err = tr_variantFromBenc(&top, data, len);
+    metrics_stop(STAGE_LOAD, start);
+
+    if (parse_err) {
+        log_err(ctx, "ERROR: Resume file could not be opened !\n");
+        return fail(ctx, TRC_ERR_LOAD);
+    }
+
+    ctx->make_changes = false;
+    err = check_variant(ctx, &top, resume_filename, NULL, NULL, NULL, verdict);
+    ctx->make_changes = make_changes;
+
+    tr_variantFree (&top);
+    metrics_stop(STAGE_FILE, file_start);
+    return err;
+}
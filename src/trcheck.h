@@ -0,0 +1,114 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#ifndef TR_CHECK_TRCHECK_H
+#define TR_CHECK_TRCHECK_H
+
+/* libtrcheck: checks and repairs of transmission resume files.
+ *
+ * Every call takes a context; errors are returned, never handled by
+ * exiting the process. Messages are written to the streams of the
+ * context (NULL: silent).
+ *
+ * Not thread-safe: the stage timings (metrics_init()) are process-wide,
+ * a scheduler set in ctx->io is not locked, and libtransmission adds the
+ * unknown keys of parsed files to its quark table without locking.
+ * Calls from several threads must be serialized by the caller.
+ *
+ *     trc_ctx ctx;
+ *     trc_verdict verdict;
+ *
+ *     trc_init(&ctx, NULL);
+ *     ctx.make_changes = true;
+ *     if (trc_check_file(&ctx, "x.0123456789abcdef.resume", NULL, NULL, &verdict) != TRC_OK)
+ *         fprintf(stderr, "%s\n", trc_strerror(ctx.error));
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+// libtransmission
+#include <libtransmission/transmission.h>
+#include <libtransmission/variant.h>
+
+#include "io.h"
+
+// Outcome of the check of one resume file
+typedef enum trc_verdict {
+    TRC_VERDICT_OK = 0,
+    TRC_VERDICT_ERROR = 1,
+    TRC_VERDICT_INCONSISTENT = 2, // found but not repaired (make_changes is false)
+    TRC_VERDICT_REPAIRED = 3,
+    TRC_VERDICT_COUNT
+} trc_verdict;
+
+typedef enum trc_error {
+    TRC_OK = 0,
+    TRC_ERR_NOMEM,
+    TRC_ERR_LOAD,           // resume file could not be opened/parsed
+    TRC_ERR_SAVE,           // resume file could not be written
+    TRC_ERR_NO_DESTINATION, // TR_KEY_destination could not be read
+    TRC_ERR_NO_NAME,        // TR_KEY_name could not be read
+    TRC_ERR_NOT_FOUND,      // downloaded files not found
+    TRC_ERR_BAD_FILENAME,   // resume filename without info-hash suffix
+    TRC_ERR_IO,             // stat(), ftw() (see errno)
+    TRC_ERR_COUNT
+} trc_error;
+
+/* Allocator of the library (libtransmission and the libc functions it
+ * calls keep their own allocations).
+ */
+typedef struct trc_allocator {
+    void * (*malloc)(size_t size, void * user);
+    void (*free)(void * ptr, void * user);
+    void * user;
+} trc_allocator;
+
+typedef struct trc_ctx {
+    // Parameters
+    bool make_changes;
+    bool verbose; // print the content of the resume files
+    FILE * out; // default: stdout
+    FILE * err; // default: stderr
+    trc_allocator allocator;
+    io_sched * io; // throttling of the walks of the downloaded files (NULL: none)
+    // Results of the last call (reset by trc_repair(), trc_replace_dir() and trc_check_*())
+    int nb_inconsistencies; // detected
+    int nb_repaired_inconsistencies; // fixed in the resume file (in memory)
+    uint64_t total_size; // bytes of the downloaded files
+    trc_error error;
+} trc_ctx;
+
+void trc_init(trc_ctx * ctx, const trc_allocator * allocator);
+const char * trc_strerror(trc_error error);
+const char * trc_verdict_to_str(trc_verdict verdict);
+
+trc_error trc_load(trc_ctx * ctx, const char path[], tr_variant * top);
+trc_error trc_save(trc_ctx * ctx, const char path[], tr_variant * top);
+void trc_print_resume(trc_ctx * ctx, tr_variant * top);
+trc_error trc_repair(trc_ctx * ctx, tr_variant * top, const char resume_filename[]);
+trc_error trc_replace_dir(trc_ctx * ctx, tr_variant * top, const char old[], const char new[]);
+trc_error trc_check_file(trc_ctx * ctx, const char path[],
+                         const char replace_old[], const char replace_new[],
+                         trc_verdict * verdict);
+trc_error trc_check_buffer(trc_ctx * ctx, const void * data, size_t len,
+                           const char resume_filename[], trc_verdict * verdict);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+This file is part of transmission-check.
+
+transmission-check is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+transmission-check is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with transmission-check.  If not, see <http://www.gnu.org/licenses/>.
+
+Copyright 2016 Ysard
+*/
+
+#include <string.h> // memcmp()
+#include <stdint.h>
+
+#include "variant_cmp.h"
+
+
+static size_t dict_size(tr_variant * dict)
+{
+    tr_quark key;
+    tr_variant * child;
+    size_t n = 0;
+
+    while (tr_variantDictChild(dict, n, &key, &child))
+        n++;
+
+    return n;
+}
+
+
+bool variant_equal(tr_variant * a, tr_variant * b)
+{
+    /* Deep comparison of two variants (dict keys order does not matter).
+     * Note: Booleans and integers are equal if they have the same value,
+     * since bencode has no boolean type.
+     */
+
+    if (tr_variantIsString(a) || tr_variantIsString(b)) {
+        const uint8_t * raw_a, * raw_b;
+        size_t len_a, len_b;
+
+        return tr_variantGetRaw(a, &raw_a, &len_a) && tr_variantGetRaw(b, &raw_b, &len_b)
+               && len_a == len_b && memcmp(raw_a, raw_b, len_a) == 0;
+    }
+
+    if (tr_variantIsReal(a) || tr_variantIsReal(b)) {
+        double real_a, real_b;
+
+        return tr_variantIsReal(a) && tr_variantIsReal(b)
+               && tr_variantGetReal(a, &real_a) && tr_variantGetReal(b, &real_b)
+               && real_a == real_b;
+    }
+
+    if (tr_variantIsList(a) || tr_variantIsList(b)) {
+        size_t i, n;
+
+        if (!tr_variantIsList(a) || !tr_variantIsList(b))
+            return false;
+
+        n = tr_variantListSize(a);
+        if (n != tr_variantListSize(b))
+            return false;
+
+        for (i = 0; i < n; i++) {
+            if (!variant_equal(tr_variantListChild(a, i), tr_variantListChild(b, i)))
+                return false;
+        }
+        return true;
+    }
+
+    if (tr_variantIsDict(a) || tr_variantIsDict(b)) {
+        tr_quark key;
+        tr_variant * child;
+        size_t i;
+
+        if (!tr_variantIsDict(a) || !tr_variantIsDict(b) || dict_size(a) != dict_size(b))
+            return false;
+
+        for (i = 0; tr_variantDictChild(a, i, &key, &child); i++) {
+            if (!variant_equal(child, tr_variantDictFind(b, key)))
+                return false;
+        }
+        return true;
+    }
+
+    // Integers & booleans
+    {
+        int64_t int_a, int_b;
+
+        return tr_variantGetInt(a, &int_a) && tr_variantGetInt(b, &int_b) && int_a == int_b;
+    }
+}